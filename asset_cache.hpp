@@ -0,0 +1,337 @@
+#ifndef CHAIGAME_ASSET_CACHE_HPP_
+#define CHAIGAME_ASSET_CACHE_HPP_
+
+#include <boost/shared_ptr.hpp>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include <sys/stat.h>
+
+#include "surface.hpp"
+#include "background_loader.hpp"
+
+/// Decodes each image file once and hands out shared handles to it.
+/// Images can also be requested asynchronously: the handle is usable right
+/// away but fully transparent until the image has been decoded in the
+/// background and published.
+/// Images whose files change can be reloaded the same way, into the
+/// handles already given out.
+class Asset_Cache
+{
+  public:
+    /// t_loader_threads decode requested and reloaded images, they are only
+    /// started once needed
+    explicit Asset_Cache(int t_loader_threads = 2)
+      : m_hits(0), m_misses(0), m_loader_threads(t_loader_threads)
+    {
+    }
+
+    /// Returns the image loaded with the given flags, decoding it only if
+    /// no one has asked for it before. An image still being decoded in the
+    /// background is decoded right away instead, and reported by the next
+    /// publish(), unless it is only being reloaded.
+    boost::shared_ptr<const Surface> get(const std::string &t_filename, bool t_rle = false)
+    {
+      const Key key(t_filename, t_rle);
+      std::map<Key, Asset>::iterator itr = m_assets.find(key);
+
+      if (itr != m_assets.end())
+      {
+        ++m_hits;
+
+        if (itr->second.pending && !itr->second.reloading)
+        {
+          // the background result is dropped once it arrives
+          Surface decoded(t_filename, t_rle);
+          finish(itr->second, decoded);
+        }
+
+        return itr->second.surface;
+      }
+
+      ++m_misses;
+      const File_Stamp stamp(t_filename);
+      boost::shared_ptr<Surface> surface(new Surface(t_filename, t_rle));
+      m_assets.insert(std::make_pair(key, Asset(surface, false, stamp)));
+      return surface;
+    }
+
+    /// Like get(), but PNGs are decoded on the background threads. Until
+    /// then the handle refers to a transparent placeholder of the image's
+    /// size, so layers and objects can already be laid out with it.
+    boost::shared_ptr<const Surface> request(const std::string &t_filename, bool t_rle = false)
+    {
+      const Key key(t_filename, t_rle);
+      std::map<Key, Asset>::iterator itr = m_assets.find(key);
+
+      if (itr != m_assets.end())
+      {
+        ++m_hits;
+        return itr->second.surface;
+      }
+
+      int width = 0;
+      int height = 0;
+
+      if (!pngSize(t_filename, width, height))
+      {
+        return get(t_filename, t_rle);
+      }
+
+      ++m_misses;
+      boost::shared_ptr<Surface> placeholder(new Surface(width, height, true));
+      m_assets.insert(std::make_pair(key, Asset(placeholder, true, File_Stamp(t_filename))));
+      loader().request(t_filename);
+      return placeholder;
+    }
+
+    /// Converts the images decoded in the background since the last call
+    /// and swaps them into their handles. Meant to be called once per
+    /// frame, outside of rendering, followed by letting the rooms know.
+    /// Appends the surfaces that changed to t_ready and returns their count.
+    size_t publish(std::vector<const Surface *> &t_ready)
+    {
+      const size_t first = t_ready.size();
+      t_ready.insert(t_ready.end(), m_ready.begin(), m_ready.end());
+      m_ready.clear();
+
+      if (!m_loader)
+      {
+        return t_ready.size() - first;
+      }
+
+      std::vector<Background_Loader::Decoded> decoded;
+      m_loader->collect(decoded);
+
+      for (std::vector<Background_Loader::Decoded>::iterator itr = decoded.begin();
+           itr != decoded.end();
+           ++itr)
+      {
+        // the same file may be wanted with and without RLE
+        std::map<Key, Asset>::iterator asset = m_assets.find(Key(itr->filename, false));
+        if (asset == m_assets.end() || !asset->second.pending)
+        {
+          asset = m_assets.find(Key(itr->filename, true));
+        }
+
+        if (asset == m_assets.end() || !asset->second.pending)
+        {
+          // evicted or loaded synchronously in the meantime
+          SDL_FreeSurface(itr->surface);
+        } else if (!itr->surface && asset->second.reloading) {
+          // likely caught half written, the next save is picked up again
+          std::cerr << "Unable to reload image: " << itr->filename << ": " << itr->error << std::endl;
+          asset->second.pending = false;
+          asset->second.reloading = false;
+        } else if (!itr->surface) {
+          throw std::runtime_error("Unable to load image: " + itr->filename + ": " + itr->error);
+        } else {
+          Surface converted(itr->surface, itr->filename, asset->first.second);
+          finish(asset->second, converted);
+        }
+      }
+
+      t_ready.insert(t_ready.end(), m_ready.begin(), m_ready.end());
+      m_ready.clear();
+
+      return t_ready.size() - first;
+    }
+
+    /// Decodes every image whose file changed since it was loaded again, in
+    /// the background. The new pixels replace the old ones in the same
+    /// handles on a later publish(), so rooms only rebake what was drawn
+    /// from them. Meant to be polled a few times a second; returns the
+    /// number of images being reloaded.
+    size_t reloadChanged()
+    {
+      size_t reloading = 0;
+
+      for (std::map<Key, Asset>::iterator itr = m_assets.begin();
+           itr != m_assets.end();
+           ++itr)
+      {
+        if (itr->second.pending)
+        {
+          continue;
+        }
+
+        const File_Stamp stamp(itr->first.first);
+
+        if (stamp.exists() && !(stamp == itr->second.stamp))
+        {
+          itr->second.stamp = stamp;
+          itr->second.pending = true;
+          itr->second.reloading = true;
+          loader().request(itr->first.first);
+          ++reloading;
+        }
+      }
+
+      return reloading;
+    }
+
+    /// Number of requested images not yet decoded
+    size_t pending() const
+    {
+      size_t count = 0;
+      for (std::map<Key, Asset>::const_iterator itr = m_assets.begin();
+           itr != m_assets.end();
+           ++itr)
+      {
+        if (itr->second.pending)
+        {
+          ++count;
+        }
+      }
+      return count;
+    }
+
+    /// Drops every asset that is no longer referenced outside of the cache,
+    /// returns the number of assets released
+    size_t evictUnused()
+    {
+      size_t evicted = 0;
+
+      std::map<Key, Asset>::iterator itr = m_assets.begin();
+      while (itr != m_assets.end())
+      {
+        if (itr->second.surface.unique())
+        {
+          m_assets.erase(itr++);
+          ++evicted;
+        } else {
+          ++itr;
+        }
+      }
+
+      return evicted;
+    }
+
+    size_t hits() const
+    {
+      return m_hits;
+    }
+
+    size_t misses() const
+    {
+      return m_misses;
+    }
+
+    size_t size() const
+    {
+      return m_assets.size();
+    }
+
+    size_t residentBytes() const
+    {
+      size_t bytes = 0;
+      for (std::map<Key, Asset>::const_iterator itr = m_assets.begin();
+           itr != m_assets.end();
+           ++itr)
+      {
+        bytes += itr->second.surface->bytes();
+      }
+      return bytes;
+    }
+
+  private:
+    Asset_Cache(const Asset_Cache &);
+    Asset_Cache &operator=(const Asset_Cache &);
+
+    typedef std::pair<std::string, bool> Key;
+
+    /// When a file was last changed, as far as it can be told without
+    /// reading it
+    struct File_Stamp
+    {
+      explicit File_Stamp(const std::string &t_filename)
+        : modified(0), size(-1)
+      {
+        struct stat info;
+        if (stat(t_filename.c_str(), &info) == 0)
+        {
+          modified = info.st_mtime;
+          size = long(info.st_size);
+        }
+      }
+
+      bool exists() const
+      {
+        return size >= 0;
+      }
+
+      bool operator==(const File_Stamp &t_rhs) const
+      {
+        return modified == t_rhs.modified && size == t_rhs.size;
+      }
+
+      time_t modified;
+      long size; // -1 if there is no such file
+    };
+
+    struct Asset
+    {
+      Asset(const boost::shared_ptr<Surface> &t_surface, bool t_pending, const File_Stamp &t_stamp)
+        : surface(t_surface), pending(t_pending), reloading(false), stamp(t_stamp)
+      {
+      }
+
+      boost::shared_ptr<Surface> surface;
+      bool pending; // waiting for the background loader
+      bool reloading; // and the surface still shows the previous version
+      File_Stamp stamp; // of the file the surface was decoded from
+    };
+
+    Background_Loader &loader()
+    {
+      if (!m_loader)
+      {
+        m_loader.reset(new Background_Loader(m_loader_threads));
+      }
+
+      return *m_loader;
+    }
+
+    void finish(Asset &t_asset, Surface &t_decoded)
+    {
+      t_asset.surface->swap(t_decoded);
+      t_asset.pending = false;
+      t_asset.reloading = false;
+      m_ready.push_back(t_asset.surface.get());
+    }
+
+    /// Reads the size from a PNG's header without decoding it, returns false
+    /// if the file is not a PNG
+    static bool pngSize(const std::string &t_filename, int &t_width, int &t_height)
+    {
+      static const unsigned char signature[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+
+      std::ifstream file(t_filename.c_str(), std::ios::binary);
+      unsigned char header[24];
+
+      if (!file.read(reinterpret_cast<char *>(header), sizeof(header))
+          || memcmp(header, signature, sizeof(signature)) != 0
+          || memcmp(header + 12, "IHDR", 4) != 0)
+      {
+        return false;
+      }
+
+      t_width = (header[16] << 24) | (header[17] << 16) | (header[18] << 8) | header[19];
+      t_height = (header[20] << 24) | (header[21] << 16) | (header[22] << 8) | header[23];
+      return t_width > 0 && t_height > 0;
+    }
+
+    std::map<Key, Asset> m_assets;
+    std::vector<const Surface *> m_ready; // finished since the last publish()
+    size_t m_hits;
+    size_t m_misses;
+    int m_loader_threads;
+    boost::shared_ptr<Background_Loader> m_loader; // NULL until first needed
+};
+
+#endif
@@ -0,0 +1,160 @@
+#ifndef CHAIGAME_BACKGROUND_LOADER_HPP_
+#define CHAIGAME_BACKGROUND_LOADER_HPP_
+
+#include <SDL/SDL.h>
+#include <SDL/SDL_image.h>
+#include <algorithm>
+#include <deque>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "mutex_lock.hpp"
+
+/// Decodes image files on background threads.
+/// Decoded images are handed back raw, the conversion to the display
+/// format is left to the thread calling collect()
+class Background_Loader
+{
+  public:
+    struct Decoded
+    {
+      Decoded(const std::string &t_filename, SDL_Surface *t_surface, const std::string &t_error)
+        : filename(t_filename), surface(t_surface), error(t_error)
+      {
+      }
+
+      std::string filename;
+      SDL_Surface *surface; // NULL if decoding failed
+      std::string error;
+    };
+
+    /// Decodes on t_threads threads
+    explicit Background_Loader(int t_threads = 1)
+      : m_mutex(SDL_CreateMutex()), m_cond(SDL_CreateCond()), m_quit(false)
+    {
+      for (int i = 0; i < std::max(t_threads, 1) && m_mutex && m_cond; ++i)
+      {
+        SDL_Thread *thread = SDL_CreateThread(&Background_Loader::run, this);
+
+        if (!thread)
+        {
+          break;
+        }
+
+        m_threads.push_back(thread);
+      }
+
+      if (m_threads.size() != size_t(std::max(t_threads, 1)))
+      {
+        const std::string err = SDL_GetError();
+        stop();
+        destroy();
+        throw std::runtime_error("Unable to start background loader: " + err);
+      }
+    }
+
+    ~Background_Loader()
+    {
+      stop();
+
+      for (std::vector<Decoded>::iterator itr = m_done.begin();
+           itr != m_done.end();
+           ++itr)
+      {
+        SDL_FreeSurface(itr->surface);
+      }
+
+      destroy();
+    }
+
+    /// Queues t_filename for decoding
+    void request(const std::string &t_filename)
+    {
+      Mutex_Lock l(m_mutex);
+      m_queue.push_back(t_filename);
+      SDL_CondSignal(m_cond);
+    }
+
+    /// Drops t_filename from the queue if decoding has not started yet
+    void cancel(const std::string &t_filename)
+    {
+      Mutex_Lock l(m_mutex);
+      m_queue.erase(std::remove(m_queue.begin(), m_queue.end(), t_filename), m_queue.end());
+    }
+
+    /// Takes ownership of everything decoded since the last call
+    void collect(std::vector<Decoded> &t_decoded)
+    {
+      Mutex_Lock l(m_mutex);
+      t_decoded.insert(t_decoded.end(), m_done.begin(), m_done.end());
+      m_done.clear();
+    }
+
+  private:
+    Background_Loader(const Background_Loader &);
+    Background_Loader &operator=(const Background_Loader &);
+
+    /// Lets every thread finish the file it is decoding and waits for them
+    void stop()
+    {
+      if (m_mutex)
+      {
+        Mutex_Lock l(m_mutex);
+        m_quit = true;
+        SDL_CondBroadcast(m_cond);
+      }
+
+      for (std::vector<SDL_Thread *>::iterator itr = m_threads.begin();
+           itr != m_threads.end();
+           ++itr)
+      {
+        SDL_WaitThread(*itr, 0);
+      }
+      m_threads.clear();
+    }
+
+    void destroy()
+    {
+      if (m_cond) SDL_DestroyCond(m_cond);
+      if (m_mutex) SDL_DestroyMutex(m_mutex);
+    }
+
+    static int run(void *t_self)
+    {
+      Background_Loader &self = *static_cast<Background_Loader *>(t_self);
+      Mutex_Lock l(self.m_mutex);
+
+      while (true)
+      {
+        while (self.m_queue.empty() && !self.m_quit)
+        {
+          SDL_CondWait(self.m_cond, self.m_mutex);
+        }
+
+        if (self.m_quit)
+        {
+          return 0;
+        }
+
+        const std::string filename = self.m_queue.front();
+        self.m_queue.pop_front();
+
+        SDL_UnlockMutex(self.m_mutex);
+        SDL_Surface *decoded = IMG_Load(filename.c_str());
+        const std::string error = decoded?"":IMG_GetError();
+        SDL_LockMutex(self.m_mutex);
+
+        self.m_done.push_back(Decoded(filename, decoded, error));
+      }
+    }
+
+    SDL_mutex *m_mutex;
+    SDL_cond *m_cond;
+    bool m_quit;
+    std::deque<std::string> m_queue;
+    std::vector<Decoded> m_done;
+    std::vector<SDL_Thread *> m_threads;
+};
+
+#endif
@@ -0,0 +1,390 @@
+#ifndef CHAIGAME_BANDED_RENDERER_HPP_
+#define CHAIGAME_BANDED_RENDERER_HPP_
+
+#include <SDL/SDL.h>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "geometry.hpp"
+#include "mutex_lock.hpp"
+#include "profiler.hpp"
+#include "surface.hpp"
+#include "renderer.hpp"
+
+/// Software renderer that composites on several threads.
+/// Drawing calls are only recorded, present() then splits the target into
+/// horizontal bands and replays the whole recording on each band in
+/// parallel, clipped to the band, so every pixel still sees the draws in
+/// their original order.
+/// Everything drawn must stay alive and unmodified until present().
+/// Targets that have to be locked are composited on the calling thread.
+class Banded_Renderer : public Renderer
+{
+  public:
+    Banded_Renderer(Surface &t_target, int t_threads)
+      : m_target(t_target), m_clip(t_target.bounds()), m_bands(std::max(t_threads, 1)),
+        m_mutex(SDL_CreateMutex()), m_start(SDL_CreateCond()), m_done(SDL_CreateCond()),
+        m_quit(false), m_generation(0), m_busy(0)
+    {
+      pixelKernels();
+
+      // the calling thread composites the first band itself
+      m_workers.resize(m_bands - 1);
+
+      for (size_t i = 0; i < m_workers.size(); ++i)
+      {
+        m_workers[i].renderer = this;
+        m_workers[i].band = int(i) + 1;
+        m_workers[i].thread = (m_mutex && m_start && m_done)?SDL_CreateThread(&Banded_Renderer::run, &m_workers[i]):0;
+
+        if (!m_workers[i].thread)
+        {
+          const std::string err = SDL_GetError();
+          destroy();
+          throw std::runtime_error("Unable to start compositing threads: " + err);
+        }
+      }
+
+      if (!m_mutex || !m_start || !m_done)
+      {
+        const std::string err = SDL_GetError();
+        destroy();
+        throw std::runtime_error("Unable to start compositing threads: " + err);
+      }
+    }
+
+    virtual ~Banded_Renderer()
+    {
+      destroy();
+    }
+
+    virtual Rect bounds() const
+    {
+      return m_target.bounds();
+    }
+
+    virtual void setClip(const Rect &t_area)
+    {
+      m_clip = t_area.intersect(m_target.bounds());
+    }
+
+    virtual Rect clip() const
+    {
+      return m_clip;
+    }
+
+    virtual void clear(const Rect &t_area)
+    {
+      record(Command(t_area.intersect(m_clip),
+            SDL_MapRGBA(m_target.m_surface->format, 0, 0, 0, SDL_ALPHA_TRANSPARENT)));
+    }
+
+    virtual void fill(const Rect &t_area, Uint8 t_r, Uint8 t_g, Uint8 t_b)
+    {
+      record(Command(t_area.intersect(m_clip),
+            SDL_MapRGBA(m_target.m_surface->format, t_r, t_g, t_b, SDL_ALPHA_OPAQUE)));
+    }
+
+    virtual void draw(const Surface &t_source, const Rect &t_source_area, const Position &t_position)
+    {
+      // clipped to the source up front, so every recorded pixel exists
+      const Rect source = t_source_area.intersect(t_source.bounds());
+      const int x = int(t_position.x()) + source.x() - t_source_area.x();
+      const int y = int(t_position.y()) + source.y() - t_source_area.y();
+
+      if (record(Command(m_clip, &t_source, source, x, y)))
+      {
+        profiler().countBlit(t_source_area.w() * t_source_area.h());
+      }
+    }
+
+    virtual void present()
+    {
+      composite();
+      m_target.flip();
+    }
+
+    virtual bool partialUpdates() const
+    {
+      return !m_target.doubleBuffered();
+    }
+
+    virtual void present(const std::vector<Rect> &t_areas)
+    {
+      composite();
+      m_target.update(t_areas);
+    }
+
+    virtual bool synced() const
+    {
+      return false;
+    }
+
+    int threads() const
+    {
+      return m_bands;
+    }
+
+  private:
+    Banded_Renderer(const Banded_Renderer &);
+    Banded_Renderer &operator=(const Banded_Renderer &);
+
+    /// A single recorded fill or blit, already clipped to the clip area that
+    /// was current when it was recorded
+    struct Command
+    {
+      /// Fill
+      Command(const Rect &t_area, Uint32 t_colour)
+        : source(0), area(t_area), source_area(0, 0, 0, 0), x(0), y(0), colour(t_colour)
+      {
+      }
+
+      /// Blit
+      Command(const Rect &t_clip, const Surface *t_source, const Rect &t_source_area, int t_x, int t_y)
+        : source(t_source),
+          area(Rect(t_x, t_y, t_source_area.w(), t_source_area.h()).intersect(t_clip)),
+          source_area(t_source_area), x(t_x), y(t_y), colour(0)
+      {
+      }
+
+      const Surface *source; // NULL for fills
+      Rect area; // target area touched
+      Rect source_area;
+      int x; // where source_area's top left corner goes, before clipping
+      int y;
+      Uint32 colour;
+    };
+
+    struct Worker
+    {
+      Worker()
+        : renderer(0), band(0), thread(0)
+      {
+      }
+
+      Banded_Renderer *renderer;
+      int band;
+      SDL_Thread *thread;
+    };
+
+    /// Returns false if the command would not touch anything
+    bool record(const Command &t_command)
+    {
+      if (t_command.area.empty())
+      {
+        return false;
+      }
+
+      m_commands.push_back(t_command);
+      return true;
+    }
+
+    Rect band(int t_index) const
+    {
+      const int height = int(m_target.height());
+      const int top = height * t_index / m_bands;
+      const int bottom = height * (t_index + 1) / m_bands;
+      return Rect(0, top, int(m_target.width()), bottom - top);
+    }
+
+    /// Replays the recording on every band and forgets it
+    void composite()
+    {
+      if (m_commands.empty())
+      {
+        return;
+      }
+
+      SDL_Surface *target = m_target.m_surface;
+      const SDL_Rect clip = target->clip_rect;
+      SDL_SetClipRect(target, 0);
+
+      if (m_workers.empty() || SDL_MUSTLOCK(target))
+      {
+        composite(m_target.bounds());
+      } else {
+        prepareSources();
+
+        {
+          Mutex_Lock l(m_mutex);
+          ++m_generation;
+          m_busy = int(m_workers.size());
+          SDL_CondBroadcast(m_start);
+        }
+
+        composite(band(0));
+
+        Mutex_Lock l(m_mutex);
+        while (m_busy > 0)
+        {
+          SDL_CondWait(m_done, m_mutex);
+        }
+      }
+
+      SDL_SetClipRect(target, &clip);
+      ++m_target.m_revision;
+      m_commands.clear();
+    }
+
+    /// Replays the recording clipped to t_band
+    void composite(const Rect &t_band) const
+    {
+      SDL_Surface *target = m_target.m_surface;
+
+      for (std::vector<Command>::const_iterator itr = m_commands.begin();
+           itr != m_commands.end();
+           ++itr)
+      {
+        const Rect area = itr->area.intersect(t_band);
+
+        if (area.empty())
+        {
+          continue;
+        }
+
+        SDL_Rect dest = area.toSDL();
+
+        if (!itr->source)
+        {
+          Surface::fillRect(target, dest, itr->colour);
+        } else {
+          Surface::blit(itr->source->m_surface, sourceRect(*itr, area), target, dest);
+        }
+      }
+    }
+
+    /// Part of t_command's source that lands on t_area
+    static SDL_Rect sourceRect(const Command &t_command, const Rect &t_area)
+    {
+      return Rect(t_command.source_area.x() + t_area.x() - t_command.x,
+          t_command.source_area.y() + t_area.y() - t_command.y,
+          t_area.w(), t_area.h()).toSDL();
+    }
+
+    /// SDL caches how to blit a source onto the surface it was last blitted
+    /// onto, and rebuilds that cache unsynchronized when the destination
+    /// changes. A one pixel blit of every source, putting back the pixel it
+    /// covered, makes sure the workers only ever read the cache.
+    void prepareSources()
+    {
+      m_sources.clear();
+      for (std::vector<Command>::const_iterator itr = m_commands.begin();
+           itr != m_commands.end();
+           ++itr)
+      {
+        if (itr->source)
+        {
+          m_sources.push_back(&*itr);
+        }
+      }
+
+      std::stable_sort(m_sources.begin(), m_sources.end(), &Banded_Renderer::bySource);
+      m_sources.erase(std::unique(m_sources.begin(), m_sources.end(), &Banded_Renderer::sameSource),
+          m_sources.end());
+
+      SDL_Surface *target = m_target.m_surface;
+      const int bpp = target->format->BytesPerPixel;
+      Uint8 saved[4];
+
+      for (std::vector<const Command *>::const_iterator itr = m_sources.begin();
+           itr != m_sources.end();
+           ++itr)
+      {
+        const Rect pixel((*itr)->area.x(), (*itr)->area.y(), 1, 1);
+        Uint8 *p = static_cast<Uint8 *>(target->pixels) + pixel.y() * target->pitch + pixel.x() * bpp;
+
+        memcpy(saved, p, bpp);
+        SDL_Rect src = sourceRect(**itr, pixel);
+        SDL_Rect dest = pixel.toSDL();
+        SDL_BlitSurface((*itr)->source->m_surface, &src, target, &dest);
+        memcpy(p, saved, bpp);
+      }
+    }
+
+    static bool bySource(const Command *t_lhs, const Command *t_rhs)
+    {
+      return t_lhs->source < t_rhs->source;
+    }
+
+    static bool sameSource(const Command *t_lhs, const Command *t_rhs)
+    {
+      return t_lhs->source == t_rhs->source;
+    }
+
+    void destroy()
+    {
+      if (m_mutex)
+      {
+        Mutex_Lock l(m_mutex);
+        m_quit = true;
+        if (m_start) SDL_CondBroadcast(m_start);
+      }
+
+      for (std::vector<Worker>::iterator itr = m_workers.begin();
+           itr != m_workers.end();
+           ++itr)
+      {
+        if (itr->thread) SDL_WaitThread(itr->thread, 0);
+        itr->thread = 0;
+      }
+
+      if (m_done) SDL_DestroyCond(m_done);
+      if (m_start) SDL_DestroyCond(m_start);
+      if (m_mutex) SDL_DestroyMutex(m_mutex);
+      m_done = 0;
+      m_start = 0;
+      m_mutex = 0;
+    }
+
+    static int run(void *t_worker)
+    {
+      const Worker &worker = *static_cast<Worker *>(t_worker);
+      Banded_Renderer &self = *worker.renderer;
+      unsigned seen = 0;
+
+      Mutex_Lock l(self.m_mutex);
+
+      while (true)
+      {
+        while (self.m_generation == seen && !self.m_quit)
+        {
+          SDL_CondWait(self.m_start, self.m_mutex);
+        }
+
+        if (self.m_quit)
+        {
+          return 0;
+        }
+
+        seen = self.m_generation;
+
+        SDL_UnlockMutex(self.m_mutex);
+        self.composite(self.band(worker.band));
+        SDL_LockMutex(self.m_mutex);
+
+        if (--self.m_busy == 0)
+        {
+          SDL_CondSignal(self.m_done);
+        }
+      }
+    }
+
+    Surface &m_target;
+    Rect m_clip;
+    int m_bands;
+    std::vector<Command> m_commands;
+    std::vector<const Command *> m_sources;
+
+    std::vector<Worker> m_workers;
+    SDL_mutex *m_mutex;
+    SDL_cond *m_start;
+    SDL_cond *m_done;
+    bool m_quit;
+    unsigned m_generation;
+    int m_busy;
+};
+
+#endif
@@ -0,0 +1,343 @@
+#include <SDL/SDL.h>
+#include <boost/shared_ptr.hpp>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+#include <cmath>
+#include <new>
+
+#include "geometry.hpp"
+#include "profiler.hpp"
+#include "surface.hpp"
+#include "renderer.hpp"
+#include "banded_renderer.hpp"
+#include "screen.hpp"
+#include "object.hpp"
+#include "sprite_atlas.hpp"
+#include "layer.hpp"
+#include "room.hpp"
+
+// Headless benchmark of the render pipeline: builds a synthetic Room,
+// renders it to an offscreen surface along a camera path and reports
+// frame times, blits and heap allocations per frame.
+
+#if __cplusplus >= 201103L
+#define BENCHMARK_THROW_BAD_ALLOC
+#define BENCHMARK_NOTHROW noexcept
+#else
+#define BENCHMARK_THROW_BAD_ALLOC throw(std::bad_alloc)
+#define BENCHMARK_NOTHROW throw()
+#endif
+
+static unsigned long g_allocations = 0;
+
+void *operator new(std::size_t t_size) BENCHMARK_THROW_BAD_ALLOC
+{
+  ++g_allocations;
+  void *p = std::malloc(t_size ? t_size : 1);
+  if (!p)
+  {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void *operator new[](std::size_t t_size) BENCHMARK_THROW_BAD_ALLOC
+{
+  return operator new(t_size);
+}
+
+void operator delete(void *t_p) BENCHMARK_NOTHROW
+{
+  std::free(t_p);
+}
+
+void operator delete[](void *t_p) BENCHMARK_NOTHROW
+{
+  std::free(t_p);
+}
+
+#ifdef __cpp_sized_deallocation
+void operator delete(void *t_p, std::size_t) BENCHMARK_NOTHROW
+{
+  std::free(t_p);
+}
+
+void operator delete[](void *t_p, std::size_t) BENCHMARK_NOTHROW
+{
+  std::free(t_p);
+}
+#endif
+
+struct Options
+{
+  Options()
+    : layers(3), layer_width(4096), layer_height(2048), objects(500), frames(1000),
+      width(640), height(480), camera("pan"), live(false), dirty_rects(false), threads(1), subpixel(1), entities(0), scale(1), atlas(false), max_p99_ms(0)
+  {
+  }
+
+  int layers;
+  int layer_width; // of the front layer, the ones behind shrink for parallax
+  int layer_height;
+  int objects; // per layer
+  int frames;
+  int width; // of the render target
+  int height;
+  std::string camera; // pan, circle or still
+  bool live; // draw objects per frame instead of baking them
+  bool dirty_rects;
+  int threads; // compositing threads, 1 for plain software rendering
+  int subpixel; // sub-pixel steps per layer, 1 for none
+  int entities; // moving sprites per layer
+  int scale; // render at size / scale and enlarge, 1 for none
+  bool atlas; // pack the sprites onto a shared page
+  double max_p99_ms; // fail if exceeded, 0 to never fail
+};
+
+void usage()
+{
+  std::cerr << "usage: chaigame_benchmark [--layers N] [--layer-size WxH] [--objects N] [--frames N]\n"
+    "  [--size WxH] [--camera pan|circle|still] [--live] [--dirty-rects] [--threads N]\n  [--subpixel N] [--entities N] [--scale N] [--atlas] [--max-p99-ms MS]\n";
+}
+
+bool parseSize(const std::string &t_arg, int &t_width, int &t_height)
+{
+  const size_t x = t_arg.find('x');
+  if (x == std::string::npos)
+  {
+    return false;
+  }
+
+  t_width = atoi(t_arg.substr(0, x).c_str());
+  t_height = atoi(t_arg.substr(x + 1).c_str());
+  return t_width > 0 && t_height > 0;
+}
+
+bool parseOptions(int argc, char *argv[], Options &t_options)
+{
+  for (int i = 1; i < argc; ++i)
+  {
+    const std::string arg(argv[i]);
+    const bool has_value = i + 1 < argc;
+
+    if (arg == "--layers" && has_value) {
+      t_options.layers = atoi(argv[++i]);
+    } else if (arg == "--layer-size" && has_value) {
+      if (!parseSize(argv[++i], t_options.layer_width, t_options.layer_height)) return false;
+    } else if (arg == "--objects" && has_value) {
+      t_options.objects = atoi(argv[++i]);
+    } else if (arg == "--frames" && has_value) {
+      t_options.frames = atoi(argv[++i]);
+    } else if (arg == "--size" && has_value) {
+      if (!parseSize(argv[++i], t_options.width, t_options.height)) return false;
+    } else if (arg == "--camera" && has_value) {
+      t_options.camera = argv[++i];
+    } else if (arg == "--live") {
+      t_options.live = true;
+    } else if (arg == "--dirty-rects") {
+      t_options.dirty_rects = true;
+    } else if (arg == "--threads" && has_value) {
+      t_options.threads = atoi(argv[++i]);
+    } else if (arg == "--subpixel" && has_value) {
+      t_options.subpixel = atoi(argv[++i]);
+    } else if (arg == "--entities" && has_value) {
+      t_options.entities = atoi(argv[++i]);
+    } else if (arg == "--scale" && has_value) {
+      t_options.scale = atoi(argv[++i]);
+    } else if (arg == "--atlas") {
+      t_options.atlas = true;
+    } else if (arg == "--max-p99-ms" && has_value) {
+      t_options.max_p99_ms = atof(argv[++i]);
+    } else {
+      return false;
+    }
+  }
+
+  return t_options.layers > 0 && t_options.frames > 0 && t_options.objects >= 0 && t_options.entities >= 0 && t_options.scale > 0
+    && (t_options.camera == "pan" || t_options.camera == "circle" || t_options.camera == "still");
+}
+
+/// Checkered backing image, opaque for the back layer and mostly
+/// transparent for the ones in front of it
+boost::shared_ptr<const Surface> makeLayerImage(int t_width, int t_height, bool t_opaque, int t_seed)
+{
+  boost::shared_ptr<Surface> image(new Surface(t_width, t_height, !t_opaque));
+
+  const int cell = 64;
+  for (int y = 0; y < t_height; y += cell)
+  {
+    for (int x = 0; x < t_width; x += cell)
+    {
+      const bool odd = ((x + y) / cell + t_seed) % 2 != 0;
+      if (t_opaque || odd)
+      {
+        image->fill(Rect(x, y, cell, cell), Uint8(x * 7 + t_seed * 40), Uint8(y * 5), odd ? 200 : 50);
+      }
+    }
+  }
+
+  return image;
+}
+
+/// Sprite with a transparent border around an opaque body
+boost::shared_ptr<const Surface> makeSprite(int t_width, int t_height, int t_seed)
+{
+  boost::shared_ptr<Surface> sprite(new Surface(t_width, t_height, true));
+  sprite->fill(Rect(t_width / 4, t_height / 4, t_width / 2, t_height / 2), Uint8(t_seed * 60), 255, 0);
+  return sprite;
+}
+
+Position cameraAt(const Options &t_options, int t_frame)
+{
+  const double pi = 3.14159265358979323846;
+  const double t = double(t_frame) / t_options.frames;
+  const double w = t_options.layer_width;
+  const double h = t_options.layer_height;
+
+  if (t_options.camera == "circle")
+  {
+    return Position(w / 2 + std::cos(t * 2 * pi) * w / 3, h / 2 + std::sin(t * 2 * pi) * h / 3);
+  } else if (t_options.camera == "pan") {
+    return Position(w * (0.1 + 0.8 * t), h / 2);
+  } else {
+    return Position(w / 2, h / 2);
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  Options options;
+
+  if (!parseOptions(argc, argv, options))
+  {
+    usage();
+    return 1;
+  }
+
+  if (!SDL_getenv("SDL_VIDEODRIVER"))
+  {
+    SDL_putenv(const_cast<char *>("SDL_VIDEODRIVER=dummy"));
+  }
+
+  Screen screen(Screen::Software);
+  Surface display(options.width, options.height, false);
+  Surface internal(std::max(options.width / options.scale, 1), std::max(options.height / options.scale, 1), false);
+  Surface &target = options.scale > 1?internal:display;
+  boost::shared_ptr<Renderer> renderer;
+  if (options.threads > 1)
+  {
+    renderer.reset(new Banded_Renderer(target, options.threads));
+  } else {
+    renderer.reset(new Software_Renderer(target));
+  }
+
+  if (options.scale > 1)
+  {
+    renderer.reset(new Scaled_Renderer(renderer, internal, display, options.scale, 0, 0));
+  }
+
+  Sprite_Atlas atlas;
+  std::vector<boost::shared_ptr<Object> > sprites;
+  for (int i = 0; i < 4; ++i)
+  {
+    const boost::shared_ptr<const Surface> image = makeSprite(32 + 32 * i, 48 + 24 * i, i);
+    sprites.push_back(options.atlas?atlas.add(image):boost::shared_ptr<Object>(new Object(image)));
+  }
+
+  Room room;
+  room.setDirtyRectUpdates(options.dirty_rects);
+
+  boost::shared_ptr<Layer> front;
+  srand(42);
+  const double setup_start = currentTime();
+
+  for (int i = 0; i < options.layers; ++i)
+  {
+    // back layers are smaller, so they scroll slower
+    const double scale = 1.0 / (options.layers - i);
+    const int w = std::max(int(options.layer_width * scale), options.width);
+    const int h = std::max(int(options.layer_height * scale), options.height);
+
+    boost::shared_ptr<Layer> layer(new Layer(makeLayerImage(w, h, i == 0, i)));
+    layer->setBakeObjects(!options.live);
+    layer->setSubpixelSteps(options.subpixel);
+    layer->reserveObjects(options.objects);
+
+    for (int o = 0; o < options.objects; ++o)
+    {
+      layer->addObject(Position(rand() % w, rand() % h), sprites[rand() % sprites.size()]);
+    }
+
+    Entity_Store &entities = layer->entities();
+    entities.reserve(options.entities);
+    entities.setWrap(Rect(0, 0, w, h));
+    for (size_t s = 0; s < sprites.size(); ++s)
+    {
+      entities.addSprite(boost::shared_ptr<const Object>(sprites[s]));
+    }
+
+    for (int e = 0; e < options.entities; ++e)
+    {
+      entities.create(Position(rand() % w, rand() % h), Position(rand() % 200 - 100, rand() % 200 - 100),
+          unsigned(rand() % sprites.size()));
+    }
+
+    room.addLayer(layer);
+    front = layer;
+  }
+
+  const double setup = currentTime() - setup_start;
+
+  std::vector<double> times;
+  times.reserve(options.frames);
+  unsigned long blits = 0;
+  unsigned long pixels = 0;
+  double updating = 0;
+  const unsigned long allocations_before = g_allocations;
+  const double start = currentTime();
+
+  for (int frame = 0; frame < options.frames; ++frame)
+  {
+    const double frame_start = currentTime();
+    room.update(1.0 / 60);
+    updating += currentTime() - frame_start;
+    room.render(*renderer, front, cameraAt(options, frame));
+    profiler().endFrame();
+    times.push_back(currentTime() - frame_start);
+
+    blits += profiler().frame(0).blits;
+    pixels += profiler().frame(0).pixels;
+  }
+
+  const double elapsed = currentTime() - start;
+  const unsigned long allocations = g_allocations - allocations_before;
+
+  std::sort(times.begin(), times.end());
+  const double p50 = times[(times.size() - 1) / 2] * 1000;
+  const double p99 = times[(times.size() - 1) * 99 / 100] * 1000;
+
+  std::cout << "setup_seconds: " << setup << "\n"
+    << "frames: " << options.frames << "\n"
+    << "seconds: " << elapsed << "\n"
+    << "fps: " << options.frames / elapsed << "\n"
+    << "frame_ms_p50: " << p50 << "\n"
+    << "frame_ms_p99: " << p99 << "\n"
+    << "frame_ms_max: " << times.back() * 1000 << "\n"
+    << "blits_per_frame: " << double(blits) / options.frames << "\n"
+    << "pixels_per_frame: " << double(pixels) / options.frames << "\n"
+    << "entity_update_us: " << updating / options.frames * 1000000 << "\n"
+    << "allocations_per_frame: " << double(allocations) / options.frames << "\n"
+    << "surface_bytes_peak: " << surfaceMemory().peakTotal() << "\n";
+
+  if (options.max_p99_ms > 0 && p99 > options.max_p99_ms)
+  {
+    std::cerr << "p99 frame time " << p99 << "ms exceeds " << options.max_p99_ms << "ms\n";
+    return 2;
+  }
+
+  return 0;
+}
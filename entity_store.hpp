@@ -0,0 +1,295 @@
+#ifndef CHAIGAME_ENTITY_STORE_HPP_
+#define CHAIGAME_ENTITY_STORE_HPP_
+
+#include <boost/shared_ptr.hpp>
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <vector>
+
+#include "geometry.hpp"
+#include "handle_table.hpp"
+#include "surface.hpp"
+#include "object.hpp"
+
+/// Refers to one entity of an Entity_Store, stays valid until the entity is
+/// destroyed. 0 never refers to anything.
+typedef unsigned Entity;
+
+/// Moving sprites, e.g. drifting clouds or NPCs, kept out of the layer's
+/// baked tiles.
+/// Every attribute lives in its own contiguous array, so a tick is one
+/// straight pass over positions and velocities the compiler can vectorize,
+/// and moving an entity never costs a rebake: entities are drawn each frame
+/// through the Room's Draw_List, on top of their layer's objects. They are
+/// drawn in the order they were created only until one is destroyed, which
+/// moves the last entity into its place; after that the order, and so
+/// which of two overlapping entities is on top, is unspecified.
+/// With buffering on, drawing sees the entities as of the last publish(),
+/// so a simulation thread can move, create and destroy them while another
+/// thread renders. Sprites still have to be added while nothing renders.
+class Entity_Store
+{
+  public:
+    Entity_Store()
+      : m_wrap(0, 0, 0, 0), m_revision(0), m_buffered(false), m_published_revision(0)
+    {
+    }
+
+    /// Returns the id entities are created with to be drawn as t_surface
+    unsigned addSprite(const boost::shared_ptr<const Surface> &t_surface)
+    {
+      return addSprite(boost::shared_ptr<const Object>(new Object(t_surface)));
+    }
+
+    /// As above, drawn as t_object's image, e.g. one packed by a Sprite_Atlas
+    unsigned addSprite(const boost::shared_ptr<const Object> &t_object)
+    {
+      m_sprites.push_back(t_object);
+      m_sprite_widths.push_back(t_object->area().w());
+      m_sprite_heights.push_back(t_object->area().h());
+      return unsigned(m_sprites.size() - 1);
+    }
+
+    /// Makes room for t_count entities, so creating them doesn't reallocate
+    void reserve(size_t t_count)
+    {
+      m_x.reserve(t_count);
+      m_y.reserve(t_count);
+      m_vx.reserve(t_count);
+      m_vy.reserve(t_count);
+      m_sprite.reserve(t_count);
+      m_entity.reserve(t_count);
+      m_handles.reserve(t_count);
+    }
+
+    /// t_velocity is in pixels per second
+    Entity create(const Position &t_position, const Position &t_velocity, unsigned t_sprite)
+    {
+      if (t_sprite >= m_sprites.size())
+      {
+        throw std::runtime_error("Unknown entity sprite");
+      }
+
+      const Entity entity = m_handles.add(m_x.size());
+      m_x.push_back(t_position.x());
+      m_y.push_back(t_position.y());
+      m_vx.push_back(t_velocity.x());
+      m_vy.push_back(t_velocity.y());
+      m_sprite.push_back(t_sprite);
+      m_entity.push_back(entity);
+      ++m_revision;
+      return entity;
+    }
+
+    /// Moves the last entity into the gap, see the class comment on order
+    void destroy(Entity t_entity)
+    {
+      const size_t index = indexOf(t_entity);
+
+      // keep the arrays dense by moving the last entity into the gap
+      const size_t last = m_x.size() - 1;
+      m_x[index] = m_x[last];
+      m_y[index] = m_y[last];
+      m_vx[index] = m_vx[last];
+      m_vy[index] = m_vy[last];
+      m_sprite[index] = m_sprite[last];
+      m_entity[index] = m_entity[last];
+      m_handles.move(m_entity[index], index);
+
+      m_x.pop_back();
+      m_y.pop_back();
+      m_vx.pop_back();
+      m_vy.pop_back();
+      m_sprite.pop_back();
+      m_entity.pop_back();
+      m_handles.remove(t_entity);
+      ++m_revision;
+    }
+
+    Position position(Entity t_entity) const
+    {
+      const size_t index = indexOf(t_entity);
+      return Position(m_x[index], m_y[index]);
+    }
+
+    void setPosition(Entity t_entity, const Position &t_position)
+    {
+      const size_t index = indexOf(t_entity);
+      m_x[index] = t_position.x();
+      m_y[index] = t_position.y();
+      ++m_revision;
+    }
+
+    Position velocity(Entity t_entity) const
+    {
+      const size_t index = indexOf(t_entity);
+      return Position(m_vx[index], m_vy[index]);
+    }
+
+    void setVelocity(Entity t_entity, const Position &t_velocity)
+    {
+      const size_t index = indexOf(t_entity);
+      m_vx[index] = t_velocity.x();
+      m_vy[index] = t_velocity.y();
+    }
+
+    /// Entities leaving t_area come back in on the opposite side, an empty
+    /// area (the default) lets them leave
+    void setWrap(const Rect &t_area)
+    {
+      m_wrap = t_area;
+    }
+
+    /// Moves every entity along its velocity for t_seconds
+    void update(double t_seconds)
+    {
+      const size_t count = m_x.size();
+
+      if (count == 0 || t_seconds == 0)
+      {
+        return;
+      }
+
+      double *x = &m_x.front();
+      double *y = &m_y.front();
+      const double *vx = &m_vx.front();
+      const double *vy = &m_vy.front();
+
+      for (size_t i = 0; i < count; ++i)
+      {
+        x[i] += vx[i] * t_seconds;
+      }
+
+      for (size_t i = 0; i < count; ++i)
+      {
+        y[i] += vy[i] * t_seconds;
+      }
+
+      if (!m_wrap.empty())
+      {
+        wrap(x, count, m_wrap.x(), m_wrap.w());
+        wrap(y, count, m_wrap.y(), m_wrap.h());
+      }
+
+      ++m_revision;
+    }
+
+    /// Calls t_func(object, x, y) for every entity overlapping t_area, with
+    /// the object it is drawn as and integer layer coordinates, in the
+    /// store's order, see the class comment
+    template<typename Func>
+    void forVisible(const Rect &t_area, Func &t_func) const
+    {
+      const std::vector<double> &xs = m_buffered?m_published_x:m_x;
+      const std::vector<double> &ys = m_buffered?m_published_y:m_y;
+      const std::vector<unsigned> &sprites = m_buffered?m_published_sprite:m_sprite;
+
+      for (size_t i = 0; i < xs.size(); ++i)
+      {
+        const unsigned sprite = sprites[i];
+        const int x = int(floor(xs[i]));
+        const int y = int(floor(ys[i]));
+
+        if (x < t_area.right() && y < t_area.bottom()
+            && x + m_sprite_widths[sprite] > t_area.x() && y + m_sprite_heights[sprite] > t_area.y())
+        {
+          t_func(*m_sprites[sprite], x, y);
+        }
+      }
+    }
+
+    /// Lets the next render know if a sprite's pixels were replaced
+    void surfacesChanged(const std::vector<const Surface *> &t_changed)
+    {
+      for (size_t i = 0; i < m_sprites.size(); ++i)
+      {
+        if (std::find(t_changed.begin(), t_changed.end(), &m_sprites[i]->surface()) != t_changed.end())
+        {
+          m_sprite_widths[i] = m_sprites[i]->area().w();
+          m_sprite_heights[i] = m_sprites[i]->area().h();
+          ++m_revision;
+        }
+      }
+    }
+
+    size_t size() const
+    {
+      return m_x.size();
+    }
+
+    /// Changes whenever an entity may have moved, appeared or disappeared,
+    /// as far as drawing can see
+    unsigned revision() const
+    {
+      return m_buffered?m_published_revision:m_revision;
+    }
+
+    /// See publish()
+    void setBuffered(bool t_buffered)
+    {
+      m_buffered = t_buffered;
+      publish();
+    }
+
+    /// With buffering on, makes the entities as they are now the ones drawn
+    void publish()
+    {
+      if (m_buffered)
+      {
+        // keeps the copies' storage, so this is a plain copy per frame
+        m_published_x.assign(m_x.begin(), m_x.end());
+        m_published_y.assign(m_y.begin(), m_y.end());
+        m_published_sprite.assign(m_sprite.begin(), m_sprite.end());
+        m_published_revision = m_revision;
+      }
+    }
+
+  private:
+    size_t indexOf(Entity t_entity) const
+    {
+      const size_t index = m_handles.index(t_entity);
+
+      if (index == Handle_Table::npos)
+      {
+        throw std::runtime_error("Requested entity doesn't exist");
+      }
+
+      return index;
+    }
+
+    /// Branch free, so it vectorizes like the integration
+    static void wrap(double *t_values, size_t t_count, double t_start, double t_size)
+    {
+      const double end = t_start + t_size;
+      for (size_t i = 0; i < t_count; ++i)
+      {
+        const double v = t_values[i];
+        t_values[i] = v + (v < t_start?t_size:0.0) - (v >= end?t_size:0.0);
+      }
+    }
+
+    std::vector<boost::shared_ptr<const Object> > m_sprites;
+    std::vector<int> m_sprite_widths;
+    std::vector<int> m_sprite_heights;
+
+    // by entity index
+    std::vector<double> m_x;
+    std::vector<double> m_y;
+    std::vector<double> m_vx; // pixels per second
+    std::vector<double> m_vy;
+    std::vector<unsigned> m_sprite;
+    std::vector<Entity> m_entity;
+
+    Handle_Table m_handles;
+    Rect m_wrap;
+    unsigned m_revision;
+
+    bool m_buffered;
+    std::vector<double> m_published_x; // as of publish(), when buffered
+    std::vector<double> m_published_y;
+    std::vector<unsigned> m_published_sprite;
+    unsigned m_published_revision;
+};
+
+#endif
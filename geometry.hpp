@@ -0,0 +1,181 @@
+#ifndef CHAIGAME_GEOMETRY_HPP_
+#define CHAIGAME_GEOMETRY_HPP_
+
+#include <SDL/SDL.h>
+#include <vector>
+#include <algorithm>
+
+class Position
+{
+  public:
+    Position(double t_x, double t_y)
+      : m_x(t_x), m_y(t_y)
+    {
+    }
+
+    const double &x() const
+    {
+      return m_x;
+    }
+
+    const double &y() const
+    {
+      return m_y;
+    }
+
+    double &x() 
+    {
+      return m_x;
+    }
+
+    double &y()
+    {
+      return m_y;
+    }
+
+    Position operator+(const Position &t_rhs) const
+    {
+      return Position(m_x + t_rhs.m_x, m_y + t_rhs.m_y);
+    }
+
+    bool operator<(const Position &t_rhs) const
+    {
+      return (m_y < t_rhs.m_y)
+        || (m_y == t_rhs.m_y && m_x < t_rhs.m_x);
+    }
+
+    bool operator==(const Position &t_rhs) const
+    {
+      return m_x == t_rhs.m_x && m_y == t_rhs.m_y;
+    }
+
+  private:
+    double m_x;
+    double m_y;
+
+};
+
+/// Integer pixel rectangle
+class Rect
+{
+  public:
+    Rect(int t_x, int t_y, int t_w, int t_h)
+      : m_x(t_x), m_y(t_y), m_w(t_w), m_h(t_h)
+    {
+    }
+
+    int x() const
+    {
+      return m_x;
+    }
+
+    int y() const
+    {
+      return m_y;
+    }
+
+    int w() const
+    {
+      return m_w;
+    }
+
+    int h() const
+    {
+      return m_h;
+    }
+
+    int right() const
+    {
+      return m_x + m_w;
+    }
+
+    int bottom() const
+    {
+      return m_y + m_h;
+    }
+
+    bool empty() const
+    {
+      return m_w <= 0 || m_h <= 0;
+    }
+
+    /// Returns the overlapping area of both rects, empty if they do not overlap
+    Rect intersect(const Rect &t_rhs) const
+    {
+      const int x = std::max(m_x, t_rhs.m_x);
+      const int y = std::max(m_y, t_rhs.m_y);
+      const int r = std::min(right(), t_rhs.right());
+      const int b = std::min(bottom(), t_rhs.bottom());
+
+      return Rect(x, y, std::max(r - x, 0), std::max(b - y, 0));
+    }
+
+    bool intersects(const Rect &t_rhs) const
+    {
+      return !intersect(t_rhs).empty();
+    }
+
+    bool operator==(const Rect &t_rhs) const
+    {
+      return m_x == t_rhs.m_x && m_y == t_rhs.m_y && m_w == t_rhs.m_w && m_h == t_rhs.m_h;
+    }
+
+    /// Smallest rect containing both rects
+    Rect unite(const Rect &t_rhs) const
+    {
+      if (empty()) return t_rhs;
+      if (t_rhs.empty()) return *this;
+
+      const int x = std::min(m_x, t_rhs.m_x);
+      const int y = std::min(m_y, t_rhs.m_y);
+      return Rect(x, y, std::max(right(), t_rhs.right()) - x, std::max(bottom(), t_rhs.bottom()) - y);
+    }
+
+    Rect translate(int t_x, int t_y) const
+    {
+      return Rect(m_x + t_x, m_y + t_y, m_w, m_h);
+    }
+
+    SDL_Rect toSDL() const
+    {
+      SDL_Rect r;
+      r.x = m_x;
+      r.y = m_y;
+      r.w = m_w;
+      r.h = m_h;
+      return r;
+    }
+
+  private:
+    int m_x;
+    int m_y;
+    int m_w;
+    int m_h;
+};
+
+/// Adds t_rect to t_rects, merging it with every rect it overlaps so the
+/// resulting areas never cover a pixel twice
+inline void mergeRect(std::vector<Rect> &t_rects, Rect t_rect)
+{
+  if (t_rect.empty())
+  {
+    return;
+  }
+
+  std::vector<Rect>::iterator itr = t_rects.begin();
+  while (itr != t_rects.end())
+  {
+    if (itr->intersects(t_rect))
+    {
+      t_rect = t_rect.unite(*itr);
+      t_rects.erase(itr);
+      itr = t_rects.begin();
+    } else {
+      ++itr;
+    }
+  }
+
+  t_rects.push_back(t_rect);
+}
+
+#endif
@@ -0,0 +1,92 @@
+#ifndef CHAIGAME_HANDLE_TABLE_HPP_
+#define CHAIGAME_HANDLE_TABLE_HPP_
+
+#include <vector>
+
+/// Stable handles to the elements of a dense array whose elements move
+/// around as others are removed.
+/// A handle is a slot number in the low bits and the slot's generation,
+/// bumped whenever the slot is freed, in the top 8 bits, so a handle to a
+/// removed element is recognised as stale instead of aliasing a new one.
+/// 0 is never a valid handle.
+class Handle_Table
+{
+  public:
+    static const size_t npos = size_t(-1);
+
+    void reserve(size_t t_count)
+    {
+      m_slots.reserve(t_count);
+    }
+
+    /// Hands out a handle for the element at t_index
+    unsigned add(size_t t_index)
+    {
+      unsigned slot;
+      if (m_free.empty())
+      {
+        slot = unsigned(m_slots.size());
+        m_slots.push_back(Slot());
+      } else {
+        slot = m_free.back();
+        m_free.pop_back();
+      }
+
+      m_slots[slot].index = unsigned(t_index);
+      return (m_slots[slot].generation << Slot_Bits) | slot;
+    }
+
+    /// npos if t_handle is stale
+    size_t index(unsigned t_handle) const
+    {
+      const unsigned slot = slotOf(t_handle);
+
+      if (slot >= m_slots.size() || m_slots[slot].generation != (t_handle >> Slot_Bits)
+          || m_slots[slot].index == unsigned(npos))
+      {
+        return npos;
+      }
+
+      return m_slots[slot].index;
+    }
+
+    /// The element of t_handle now lives at t_index
+    void move(unsigned t_handle, size_t t_index)
+    {
+      m_slots[slotOf(t_handle)].index = unsigned(t_index);
+    }
+
+    /// t_handle must be valid
+    void remove(unsigned t_handle)
+    {
+      Slot &slot = m_slots[slotOf(t_handle)];
+      slot.index = unsigned(npos);
+      slot.generation = slot.generation % Max_Generation + 1;
+      m_free.push_back(slotOf(t_handle));
+    }
+
+  private:
+    static const unsigned Slot_Bits = 24;
+    static const unsigned Max_Generation = 255;
+
+    struct Slot
+    {
+      Slot()
+        : index(unsigned(npos)), generation(1)
+      {
+      }
+
+      unsigned index;
+      unsigned generation;
+    };
+
+    static unsigned slotOf(unsigned t_handle)
+    {
+      return t_handle & ((1u << Slot_Bits) - 1);
+    }
+
+    std::vector<Slot> m_slots; // by slot number
+    std::vector<unsigned> m_free; // slots to reuse
+};
+
+#endif
@@ -0,0 +1,929 @@
+#ifndef CHAIGAME_LAYER_HPP_
+#define CHAIGAME_LAYER_HPP_
+
+#include <boost/shared_ptr.hpp>
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "geometry.hpp"
+#include "profiler.hpp"
+#include "surface.hpp"
+#include "renderer.hpp"
+#include "object.hpp"
+#include "entity_store.hpp"
+#include "background_loader.hpp"
+
+/// Describes a layer stored as a grid of separate tile images, named
+/// <base>_<column>_<row><extension>, e.g. play_3_1.png.
+/// t_opaque promises every tile fully covers what is below it, which can't
+/// be checked up front as the tiles are only loaded when needed.
+struct Tile_Set
+{
+  Tile_Set(const std::string &t_base, const std::string &t_extension,
+      int t_width, int t_height, int t_tile_width, int t_tile_height, bool t_opaque = false)
+    : base(t_base), extension(t_extension), width(t_width), height(t_height),
+      tile_width(t_tile_width), tile_height(t_tile_height), opaque(t_opaque)
+  {
+  }
+
+  std::string filename(int t_column, int t_row) const
+  {
+    std::ostringstream oss;
+    oss << base << "_" << t_column << "_" << t_row << extension;
+    return oss.str();
+  }
+
+  std::string base;
+  std::string extension;
+  int width;
+  int height;
+  int tile_width;
+  int tile_height;
+  bool opaque;
+};
+
+/// A layer is kept as a grid of tiles, each with its own backing image and
+/// a copy of it with the layer's objects baked in.
+/// A layer made from a single image is one tile that is always resident.
+/// A chunked layer only keeps the tiles near the last rendered viewport
+/// resident: visible tiles are loaded on demand, the ring around them is
+/// streamed in the background and tiles further out are released, which
+/// bounds memory regardless of the layer's size.
+class Layer
+{
+  public:
+    Layer(const boost::shared_ptr<const Surface> &t_image)
+      : m_dirty(), m_bake_objects(true), m_subpixel_steps(1), m_width(int(t_image->width())), m_height(int(t_image->height())),
+        m_tile_width(m_width), m_tile_height(m_height), m_columns(1), m_rows(1),
+        m_objects(m_width, m_height)
+    {
+      m_tiles.push_back(Tile(t_image->bounds()));
+      m_tiles.front().backing = t_image;
+      t_image->setCategory(Surface_Memory::Layer_Backing);
+      // baked when first shown, or ahead of that by prebake()
+    }
+
+    Layer(const Tile_Set &t_tiles)
+      : m_dirty(), m_bake_objects(true), m_subpixel_steps(1), m_width(t_tiles.width), m_height(t_tiles.height),
+        m_tile_width(t_tiles.tile_width), m_tile_height(t_tiles.tile_height),
+        m_columns((t_tiles.width + t_tiles.tile_width - 1) / t_tiles.tile_width),
+        m_rows((t_tiles.height + t_tiles.tile_height - 1) / t_tiles.tile_height),
+        m_tile_set(new Tile_Set(t_tiles)), m_loader(new Background_Loader()),
+        m_objects(m_width, m_height)
+    {
+      for (int row = 0; row < m_rows; ++row)
+      {
+        for (int column = 0; column < m_columns; ++column)
+        {
+          m_tiles.push_back(Tile(Rect(column * m_tile_width, row * m_tile_height,
+                  std::min(m_tile_width, m_width - column * m_tile_width),
+                  std::min(m_tile_height, m_height - row * m_tile_height))));
+          m_tiles.back().filename = t_tiles.filename(column, row);
+          m_tile_index[m_tiles.back().filename] = m_tiles.size() - 1;
+        }
+      }
+    }
+
+    /// Placing the same object at the same position twice only places it
+    /// once, and returns the handle of that placement
+    Object_Handle addObject(Position t_p, const boost::shared_ptr<Object> &t_obj, unsigned t_flags = 0)
+    {
+      const size_t count = m_objects.size();
+      const Object_Handle handle = m_objects.insert(t_p, t_obj, t_flags);
+
+      if (m_objects.size() != count && !(t_flags & Object_Grid::Placement::Hidden))
+      {
+        invalidate(t_obj->bounds(t_p));
+      }
+
+      return handle;
+    }
+
+    void moveObject(Position t_from, const boost::shared_ptr<Object> &t_obj, Position t_to)
+    {
+      removeObject(t_from, t_obj);
+      addObject(t_to, t_obj);
+    }
+
+    void moveObject(Object_Handle t_handle, Position t_to)
+    {
+      const Object_Grid::Placement &placement = get(t_handle);
+      const Rect from = placement.bounds;
+      const bool hidden = (placement.flags & Object_Grid::Placement::Hidden) != 0;
+
+      m_objects.move(t_handle, t_to);
+
+      if (!hidden)
+      {
+        invalidate(from);
+        invalidate(get(t_handle).bounds);
+      }
+    }
+
+    void removeObject(Position t_p, const boost::shared_ptr<Object> &t_obj)
+    {
+      if (!m_objects.remove(t_p, t_obj))
+      {
+        throw std::runtime_error("Requested object doesn't exist on layer");
+      }
+
+      invalidate(t_obj->bounds(t_p));
+    }
+
+    void removeObject(Object_Handle t_handle)
+    {
+      const Rect bounds = get(t_handle).bounds;
+      m_objects.remove(t_handle);
+      invalidate(bounds);
+    }
+
+    /// Flags are Object_Grid::Placement::Flags, hidden objects are kept on
+    /// the layer but not drawn
+    void setObjectFlags(Object_Handle t_handle, unsigned t_flags)
+    {
+      const Object_Grid::Placement &placement = get(t_handle);
+
+      if ((placement.flags ^ t_flags) & Object_Grid::Placement::Hidden)
+      {
+        invalidate(placement.bounds);
+      }
+
+      m_objects.setFlags(t_handle, t_flags);
+    }
+
+    const Object_Grid::Placement &object(Object_Handle t_handle) const
+    {
+      return get(t_handle);
+    }
+
+    /// Makes room for t_count objects, so placing them doesn't reallocate
+    void reserveObjects(size_t t_count)
+    {
+      m_objects.reserve(t_count);
+    }
+
+    size_t objectCount() const
+    {
+      return m_objects.size();
+    }
+
+    /// Rebakes whatever was drawn from surfaces whose pixels have since been
+    /// replaced, e.g. placeholders published by the Asset_Cache
+    void surfacesChanged(const std::vector<const Surface *> &t_changed)
+    {
+      std::vector<const Surface *> changed(t_changed);
+      std::sort(changed.begin(), changed.end());
+
+      for (std::vector<Tile>::iterator itr = m_tiles.begin();
+           itr != m_tiles.end();
+           ++itr)
+      {
+        if (itr->backing && std::binary_search(changed.begin(), changed.end(), itr->backing.get()))
+        {
+          // the format may have changed too, so start over from a fresh
+          // copy when next shown or prebaked
+          releaseBaked(*itr);
+
+          // and a single image its size, objects past the new edges are
+          // kept in the grid's border cells
+          if (!m_loader && !(itr->area == itr->backing->bounds()))
+          {
+            itr->area = itr->backing->bounds();
+            m_width = m_tile_width = itr->area.w();
+            m_height = m_tile_height = itr->area.h();
+          }
+          invalidate(itr->area);
+        }
+      }
+
+      const std::vector<Object_Grid::Placement> &placements = m_objects.placements();
+      for (size_t i = 0; i < placements.size(); ++i)
+      {
+        const Object_Grid::Placement &placement = placements[i];
+
+        if (std::binary_search(changed.begin(), changed.end(), &placement.object->surface()))
+        {
+          invalidate(placement.bounds);
+
+          // a reloaded image may have changed size
+          if (!(placement.object->bounds(placement.position) == placement.bounds))
+          {
+            m_objects.move(placement.handle, placement.position);
+            invalidate(placement.bounds);
+          }
+        }
+      }
+
+      m_entities.surfacesChanged(t_changed);
+    }
+
+    /// Hands the pending changes to the tiles they fall on, which rebake
+    /// them the next time that part of the tile is rendered, so objects
+    /// changing off-screen cost nothing until scrolled into view. render()
+    /// does this itself, the Room calls it for layers hidden this frame so
+    /// their changes aren't reported again.
+    void flushChanges() const
+    {
+      for (std::vector<Rect>::const_iterator dirty = m_dirty.begin();
+           dirty != m_dirty.end() && m_bake_objects;
+           ++dirty)
+      {
+        for (int row = firstRow(*dirty); row <= lastRow(*dirty); ++row)
+        {
+          for (int column = firstColumn(*dirty); column <= lastColumn(*dirty); ++column)
+          {
+            Tile &tile = m_tiles[row * m_columns + column];
+
+            if (tile.baked)
+            {
+              addArea(tile.stale, dirty->intersect(tile.area));
+            }
+          }
+        }
+      }
+      m_dirty.clear();
+    }
+
+    /// Does some of the baking the layer would otherwise do when it is next
+    /// shown, e.g. for a room that is about to be entered: bakes resident
+    /// tiles, rebakes their pending changes and makes their pre-shifted
+    /// copies. Stops after about t_budget pieces of work, a piece being
+    /// Prebake_Piece pixels baked or resampled, and picks up from there on
+    /// the next call, part way through a copy if need be. Returns the pieces
+    /// done, fewer than t_budget once nothing is left to do.
+    /// Tiles of a chunked layer are still only loaded once they are near the
+    /// viewport.
+    size_t prebake(size_t t_budget) const
+    {
+      flushChanges();
+
+      const size_t copies = m_subpixel_steps * m_subpixel_steps - 1;
+      size_t done = 0;
+
+      for (std::vector<Tile>::iterator tile = m_tiles.begin();
+           tile != m_tiles.end() && done < t_budget;
+           ++tile)
+      {
+        if (tile->backing && !tile->baked)
+        {
+          bake(*tile);
+          done += pieces(tile->area.w() * tile->area.h());
+        } else if (tile->baked && !tile->stale.empty()) {
+          int pixels = 0;
+          for (std::vector<Rect>::const_iterator itr = tile->stale.begin();
+               itr != tile->stale.end();
+               ++itr)
+          {
+            pixels += itr->w() * itr->h() * int(1 + tile->shifted.size());
+          }
+          rebakeStale(*tile, tile->area);
+          done += pieces(pixels);
+        }
+
+        while (tile->baked && shiftedDone(*tile) < copies && done < t_budget)
+        {
+          const int rows = std::max(int((t_budget - done) * Prebake_Piece / tile->area.w()), 1);
+          done += pieces(addShifted(*tile, rows) * tile->area.w());
+        }
+      }
+
+      return done;
+    }
+
+    void render(Renderer &t_renderer, const Position &t_offset) const
+    {
+      // Only draw the part of the layer that lands on the target, so the
+      // cost scales with the target's size rather than the layer's
+      const int xoffset = int(floor(t_offset.x()));
+      const int yoffset = int(floor(t_offset.y()));
+      const size_t shift = shiftIndex(t_offset.x() - xoffset, t_offset.y() - yoffset);
+
+      const Rect viewport = t_renderer.clip().translate(-xoffset, -yoffset);
+
+      // Residency follows the whole target, not the area being drawn, so
+      // rendering several dirty areas in a frame doesn't release tiles
+      // another area needs, or has already drawn from
+      if (m_loader)
+      {
+        updateResidency(t_renderer.bounds().translate(-xoffset, -yoffset));
+      }
+
+      // baked copies released by releaseCaches() come back once shown
+      for (int row = firstRow(viewport); row <= lastRow(viewport); ++row)
+      {
+        for (int column = firstColumn(viewport); column <= lastColumn(viewport); ++column)
+        {
+          Tile &tile = m_tiles[row * m_columns + column];
+
+          if (tile.backing && !tile.baked)
+          {
+            bake(tile);
+          }
+        }
+      }
+
+      flushChanges();
+
+      // Restore and re-composite just the areas objects were added to,
+      // moved across or removed from, where they reach what is about to be
+      // shown.
+      // Filtering for the pre-shifted copies reaches one pixel left and up.
+      const Rect shown(viewport.x() - 1, viewport.y() - 1, viewport.w() + 1, viewport.h() + 1);
+      for (int row = firstRow(shown); row <= lastRow(shown); ++row)
+      {
+        for (int column = firstColumn(shown); column <= lastColumn(shown); ++column)
+        {
+          Tile &tile = m_tiles[row * m_columns + column];
+
+          if (tile.baked && !tile.stale.empty())
+          {
+            rebakeStale(tile, shown);
+          }
+        }
+      }
+
+      // Pre-shifted copies of newly baked tiles, or dropped when the
+      // setting changed
+      const size_t copies = m_subpixel_steps * m_subpixel_steps - 1;
+      for (std::vector<Tile>::iterator tile = m_tiles.begin();
+           tile != m_tiles.end() && copies > 0;
+           ++tile)
+      {
+        while (tile->baked && shiftedDone(*tile) < copies)
+        {
+          addShifted(*tile, tile->area.h());
+        }
+      }
+
+      for (int row = firstRow(viewport); row <= lastRow(viewport); ++row)
+      {
+        for (int column = firstColumn(viewport); column <= lastColumn(viewport); ++column)
+        {
+          const Tile &tile = m_tiles[row * m_columns + column];
+          const Rect visible = tile.area.intersect(viewport);
+
+          if (!visible.empty() && tile.baked)
+          {
+            t_renderer.draw(shift == 0 || shift > shiftedDone(tile)?*tile.baked:*tile.shifted[shift - 1],
+                Rect(visible.x() - tile.area.x(), visible.y() - tile.area.y(), visible.w(), visible.h()),
+                Position(xoffset + visible.x(), yoffset + visible.y()));
+          }
+        }
+      }
+    }
+
+    double width() const
+    {
+      return m_width;
+    }
+
+    /// By default objects are baked into the layer's tiles, which suits
+    /// props that rarely change. Otherwise they are left out of the tiles
+    /// and drawn each frame through the Room's Draw_List, so moving them
+    /// never costs a rebake.
+    void setBakeObjects(bool t_bake)
+    {
+      if (t_bake != m_bake_objects)
+      {
+        m_bake_objects = t_bake;
+
+        for (std::vector<Tile>::iterator itr = m_tiles.begin();
+             itr != m_tiles.end();
+             ++itr)
+        {
+          if (itr->baked)
+          {
+            bake(*itr);
+          }
+        }
+      }
+    }
+
+    bool bakesObjects() const
+    {
+      return m_bake_objects;
+    }
+
+    /// Sub-pixel scrolling: with t_steps above 1 the layer keeps t_steps
+    /// squared copies of its baked image, pre-shifted by fractions of a pixel
+    /// in each direction, and renders the one closest to the fractional part
+    /// of its offset. This smooths slow scrolling at the cost of that many
+    /// times the memory and bake time, 2 or 4 steps are usually plenty.
+    /// Chunked layers, whose tiles could not be filtered across their seams,
+    /// ignore this.
+    void setSubpixelSteps(int t_steps)
+    {
+      const int steps = m_loader?1:std::max(t_steps, 1);
+
+      if (steps != m_subpixel_steps)
+      {
+        m_subpixel_steps = steps;
+
+        for (std::vector<Tile>::iterator itr = m_tiles.begin();
+             itr != m_tiles.end();
+             ++itr)
+        {
+          itr->shifted.clear();
+        }
+
+        // render() brings the copies back
+        invalidate(Rect(0, 0, m_width, m_height));
+      }
+    }
+
+    int subpixelSteps() const
+    {
+      return m_subpixel_steps;
+    }
+
+    /// The offset the layer actually renders at when asked for t_offset:
+    /// whole pixels, or the nearest sub-pixel step
+    Position snap(const Position &t_offset) const
+    {
+      if (m_subpixel_steps == 1)
+      {
+        return Position(int(t_offset.x()), int(t_offset.y()));
+      }
+
+      return Position(floor(t_offset.x() * m_subpixel_steps + 0.5) / m_subpixel_steps,
+          floor(t_offset.y() * m_subpixel_steps + 0.5) / m_subpixel_steps);
+    }
+
+    /// Appends the objects overlapping t_area, in layer coordinates, to
+    /// t_found in paint order
+    void findObjects(const Rect &t_area, std::vector<const Object_Grid::Placement *> &t_found) const
+    {
+      m_objects.query(t_area, t_found);
+    }
+
+    /// Sprites moving over the layer, never baked into it
+    Entity_Store &entities()
+    {
+      return m_entities;
+    }
+
+    const Entity_Store &entities() const
+    {
+      return m_entities;
+    }
+
+    /// Every object placed on the layer
+    const Object_Grid &objects() const
+    {
+      return m_objects;
+    }
+
+    /// The backing image of a layer made from a single image, NULL for
+    /// chunked layers
+    boost::shared_ptr<const Surface> image() const
+    {
+      return m_loader?boost::shared_ptr<const Surface>():m_tiles.front().backing;
+    }
+
+    /// Areas, in layer coordinates, that will change on the next render
+    const std::vector<Rect> &pendingChanges() const
+    {
+      return m_dirty;
+    }
+
+    /// True if the layer fully hides everything rendered below it, letting
+    /// the Room skip those layers. Chunked layers are only opaque if their
+    /// Tile_Set says so.
+    bool opaque() const
+    {
+      return m_loader?m_tile_set->opaque:m_tiles.front().backing->opaque();
+    }
+
+    double height() const
+    {
+      return m_height;
+    }
+
+    /// Releases the pixels the layer can do without while t_viewport, in
+    /// layer coordinates, is what gets rendered: the baked copies of tiles
+    /// outside it, rebaked from their backing images when they come into
+    /// view, and the tiles of a chunked layer held beyond the ring streamed
+    /// around it. An empty viewport, for a layer that isn't shown at all,
+    /// releases every baked copy. Returns the bytes released.
+    size_t releaseCaches(const Rect &t_viewport)
+    {
+      const size_t before = surfaceMemory().total();
+
+      // filtering for the pre-shifted copies reaches one pixel left and up
+      const Rect shown(t_viewport.x() - 1, t_viewport.y() - 1, t_viewport.w() + 1, t_viewport.h() + 1);
+      for (std::vector<Tile>::iterator tile = m_tiles.begin();
+           tile != m_tiles.end();
+           ++tile)
+      {
+        if (tile->baked && (t_viewport.empty() || !tile->area.intersects(shown)))
+        {
+          releaseBaked(*tile);
+        }
+      }
+
+      if (m_loader && !t_viewport.empty())
+      {
+        const Rect nearby(t_viewport.x() - m_tile_width, t_viewport.y() - m_tile_height,
+            t_viewport.w() + 2 * m_tile_width, t_viewport.h() + 2 * m_tile_height);
+
+        std::vector<int>::iterator live = m_live.begin();
+        for (std::vector<int>::iterator itr = m_live.begin();
+             itr != m_live.end();
+             ++itr)
+        {
+          if (m_tiles[*itr].area.intersects(nearby))
+          {
+            *live++ = *itr;
+          } else {
+            release(m_tiles[*itr]);
+          }
+        }
+        m_live.erase(live, m_live.end());
+      }
+
+      return before - surfaceMemory().total();
+    }
+
+    /// Number of tiles currently holding pixel data
+    size_t residentTiles() const
+    {
+      size_t resident = 0;
+      for (std::vector<Tile>::const_iterator itr = m_tiles.begin();
+           itr != m_tiles.end();
+           ++itr)
+      {
+        if (itr->backing)
+        {
+          ++resident;
+        }
+      }
+      return resident;
+    }
+
+
+  private:
+    static const size_t Max_Dirty_Areas = 64;
+    static const int Prebake_Piece = 256 * 256; // pixels, see prebake()
+
+    struct Tile
+    {
+      Tile(const Rect &t_area)
+        : area(t_area), shifted_rows(0), pending(false)
+      {
+      }
+
+      Rect area; // in layer coordinates
+      std::string filename; // empty unless chunked
+      boost::shared_ptr<const Surface> backing;
+      boost::shared_ptr<Surface> baked; // backing with objects baked in, NULL if not resident or released
+      std::vector<Rect> stale; // areas of baked still to be re-composited, in layer coordinates
+      std::vector<boost::shared_ptr<Surface> > shifted; // baked moved by sub-pixel step 1 onwards
+      int shifted_rows; // of the last of shifted resampled so far, all of them once it is complete
+      bool pending; // queued on the background loader
+    };
+
+    static int floorDiv(int t_value, int t_divisor)
+    {
+      return t_value >= 0 ? t_value / t_divisor : -((t_divisor - 1 - t_value) / t_divisor);
+    }
+
+    int firstColumn(const Rect &t_area) const
+    {
+      return std::max(floorDiv(t_area.x(), m_tile_width), 0);
+    }
+
+    int lastColumn(const Rect &t_area) const
+    {
+      return std::min(floorDiv(t_area.right() - 1, m_tile_width), m_columns - 1);
+    }
+
+    int firstRow(const Rect &t_area) const
+    {
+      return std::max(floorDiv(t_area.y(), m_tile_height), 0);
+    }
+
+    int lastRow(const Rect &t_area) const
+    {
+      return std::min(floorDiv(t_area.bottom() - 1, m_tile_height), m_rows - 1);
+    }
+
+    /// Records t_area as needing a rebake, merging it with any dirty area it
+    /// touches so overlapping changes are only re-composited once. Past a
+    /// few dozen separate areas, as when thousands of objects are placed at
+    /// once, they are collapsed into their union instead, keeping each call
+    /// cheap.
+    void invalidate(const Rect &t_area)
+    {
+      addArea(m_dirty, t_area);
+    }
+
+    static void addArea(std::vector<Rect> &t_areas, const Rect &t_area)
+    {
+      if (t_areas.size() < Max_Dirty_Areas)
+      {
+        mergeRect(t_areas, t_area);
+      } else if (!t_area.empty()) {
+        Rect all = t_area;
+        for (std::vector<Rect>::const_iterator itr = t_areas.begin();
+             itr != t_areas.end();
+             ++itr)
+        {
+          all = all.unite(*itr);
+        }
+        t_areas.assign(1, all);
+      }
+    }
+
+    const Object_Grid::Placement &get(Object_Handle t_handle) const
+    {
+      const Object_Grid::Placement *placement = m_objects.get(t_handle);
+
+      if (!placement)
+      {
+        throw std::runtime_error("Requested object doesn't exist on layer");
+      }
+
+      return *placement;
+    }
+
+    /// A copy of t_image to bake onto, counted as cache
+    static boost::shared_ptr<Surface> cacheCopy(const Surface &t_image)
+    {
+      boost::shared_ptr<Surface> copy(new Surface(t_image));
+      copy->setCategory(Surface_Memory::Baked_Cache);
+      return copy;
+    }
+
+    void bake(Tile &t_tile) const
+    {
+      Profile_Scope scope(Profiler::Bake);
+      t_tile.baked = cacheCopy(*t_tile.backing);
+      t_tile.shifted.clear();
+      t_tile.stale.clear();
+      composite(t_tile, t_tile.area);
+      // the pre-shifted copies are made by render() or prebake()
+    }
+
+    /// Restores t_area (in layer coordinates) of the tile from its backing
+    /// image and re-composites the objects overlapping it
+    void rebake(Tile &t_tile, const Rect &t_area) const
+    {
+      Profile_Scope scope(Profiler::Bake);
+      t_tile.baked->copy(*t_tile.backing, t_area.translate(-t_tile.area.x(), -t_tile.area.y()));
+      composite(t_tile, t_area);
+      updateShifted(t_tile, t_area);
+    }
+
+    /// Rebakes the stale areas of the tile reaching into t_shown, keeping
+    /// the others for when they are shown
+    void rebakeStale(Tile &t_tile, const Rect &t_shown) const
+    {
+      std::vector<Rect>::iterator kept = t_tile.stale.begin();
+      for (std::vector<Rect>::iterator itr = t_tile.stale.begin();
+           itr != t_tile.stale.end();
+           ++itr)
+      {
+        if (itr->intersects(t_shown))
+        {
+          rebake(t_tile, *itr);
+        } else {
+          *kept++ = *itr;
+        }
+      }
+      t_tile.stale.erase(kept, t_tile.stale.end());
+    }
+
+    /// Index of the pre-shifted copy closest to a fractional offset, 0 for
+    /// the baked image itself
+    size_t shiftIndex(double t_xfraction, double t_yfraction) const
+    {
+      const int column = std::min(int(t_xfraction * m_subpixel_steps + 0.5), m_subpixel_steps - 1);
+      const int row = std::min(int(t_yfraction * m_subpixel_steps + 0.5), m_subpixel_steps - 1);
+      return row * m_subpixel_steps + column;
+    }
+
+    static size_t pieces(int t_pixels)
+    {
+      return std::max(size_t((t_pixels + Prebake_Piece - 1) / Prebake_Piece), size_t(1));
+    }
+
+    /// Number of the tile's pre-shifted copies that are complete
+    static size_t shiftedDone(const Tile &t_tile)
+    {
+      return t_tile.shifted.size() - (!t_tile.shifted.empty() && t_tile.shifted_rows < t_tile.area.h()?1:0);
+    }
+
+    /// Brings the pre-shifted copies the tile has up to date with t_area
+    /// (in layer coordinates) of the baked image, as far as they have been
+    /// made. The rest is made from the updated image by addShifted().
+    void updateShifted(Tile &t_tile, const Rect &t_area) const
+    {
+      const size_t copies = m_subpixel_steps * m_subpixel_steps - 1;
+
+      if (t_tile.shifted.size() > copies)
+      {
+        t_tile.shifted.clear();
+      }
+
+      if (t_tile.shifted.empty())
+      {
+        return;
+      }
+
+      Profile_Scope scope(Profiler::Bake);
+
+      // filtering reaches one pixel left and up, so a change shows up to
+      // one pixel further right and down
+      const Rect area(t_area.x() - t_tile.area.x(), t_area.y() - t_tile.area.y(), t_area.w() + 1, t_area.h() + 1);
+
+      for (size_t i = 0; i < t_tile.shifted.size(); ++i)
+      {
+        resampleShifted(t_tile, i, i + 1 < t_tile.shifted.size()?area
+            :area.intersect(Rect(0, 0, t_tile.area.w(), t_tile.shifted_rows)));
+      }
+    }
+
+    /// Resamples up to t_rows more rows of the first pre-shifted copy of
+    /// the tile that isn't complete, starting a new one if need be.
+    /// Returns the rows resampled.
+    int addShifted(Tile &t_tile, int t_rows) const
+    {
+      Profile_Scope scope(Profiler::Bake);
+
+      if (shiftedDone(t_tile) == t_tile.shifted.size())
+      {
+        t_tile.shifted.push_back(boost::shared_ptr<Surface>(new Surface(*t_tile.baked)));
+        t_tile.shifted_rows = 0;
+      }
+
+      const int rows = std::min(t_rows, t_tile.area.h() - t_tile.shifted_rows);
+      resampleShifted(t_tile, t_tile.shifted.size() - 1, Rect(0, t_tile.shifted_rows, t_tile.area.w(), rows));
+      t_tile.shifted_rows += rows;
+      return rows;
+    }
+
+    /// Redraws t_area, in tile coordinates, of pre-shifted copy t_index
+    void resampleShifted(Tile &t_tile, size_t t_index, const Rect &t_area) const
+    {
+      const int column = int(t_index + 1) % m_subpixel_steps;
+      const int row = int(t_index + 1) / m_subpixel_steps;
+      t_tile.shifted[t_index]->resample(*t_tile.baked, t_area,
+          256 * column / m_subpixel_steps, 256 * row / m_subpixel_steps);
+    }
+
+    /// Renders the parts of objects falling inside t_area onto the tile
+    void composite(Tile &t_tile, const Rect &t_area) const
+    {
+      if (!m_bake_objects)
+      {
+        return;
+      }
+
+      std::vector<const Object_Grid::Placement *> found;
+      m_objects.query(t_area, found);
+
+      for (std::vector<const Object_Grid::Placement *>::const_iterator itr = found.begin();
+           itr != found.end();
+           ++itr)
+      {
+        const Rect &bounds = (*itr)->bounds;
+        const Rect overlap = bounds.intersect(t_area);
+
+        (*itr)->object->render(*t_tile.baked, 
+            Position(overlap.x() - t_tile.area.x(), overlap.y() - t_tile.area.y()),
+            overlap.translate(-bounds.x(), -bounds.y()));
+      }
+    }
+
+    void makeResident(Tile &t_tile, SDL_Surface *t_decoded) const
+    {
+      t_tile.backing.reset(new Surface(t_decoded, t_tile.filename, false));
+      t_tile.backing->setCategory(Surface_Memory::Layer_Backing);
+      t_tile.pending = false;
+      bake(t_tile);
+    }
+
+    /// Picks up streamed tiles, loads any visible tile that is still missing,
+    /// queues the ring of tiles around the viewport and releases far tiles
+    void updateResidency(const Rect &t_viewport) const
+    {
+      std::vector<Background_Loader::Decoded> decoded;
+      m_loader->collect(decoded);
+
+      for (std::vector<Background_Loader::Decoded>::iterator itr = decoded.begin();
+           itr != decoded.end();
+           ++itr)
+      {
+        Tile &tile = m_tiles[m_tile_index.find(itr->filename)->second];
+
+        if (!tile.pending)
+        {
+          // released or loaded synchronously in the meantime
+          SDL_FreeSurface(itr->surface);
+        } else if (!itr->surface) {
+          throw std::runtime_error("Unable to load tile: " + itr->filename + ": " + itr->error);
+        } else {
+          makeResident(tile, itr->surface);
+        }
+      }
+
+      const Rect nearby(t_viewport.x() - m_tile_width, t_viewport.y() - m_tile_height,
+          t_viewport.w() + 2 * m_tile_width, t_viewport.h() + 2 * m_tile_height);
+      const Rect keep(nearby.x() - m_tile_width, nearby.y() - m_tile_height,
+          nearby.w() + 2 * m_tile_width, nearby.h() + 2 * m_tile_height);
+
+      for (int row = firstRow(nearby); row <= lastRow(nearby); ++row)
+      {
+        for (int column = firstColumn(nearby); column <= lastColumn(nearby); ++column)
+        {
+          const int index = row * m_columns + column;
+          Tile &tile = m_tiles[index];
+
+          if (tile.backing)
+          {
+            continue;
+          }
+
+          if (!tile.pending)
+          {
+            m_live.push_back(index);
+          }
+
+          if (tile.area.intersects(t_viewport))
+          {
+            if (tile.pending)
+            {
+              m_loader->cancel(tile.filename);
+            }
+            makeResident(tile, IMG_Load(tile.filename.c_str()));
+          } else if (!tile.pending) {
+            m_loader->request(tile.filename);
+            tile.pending = true;
+          }
+        }
+      }
+
+      std::vector<int>::iterator live = m_live.begin();
+      for (std::vector<int>::iterator itr = m_live.begin();
+           itr != m_live.end();
+           ++itr)
+      {
+        Tile &tile = m_tiles[*itr];
+
+        if (tile.area.intersects(keep))
+        {
+          *live++ = *itr;
+        } else {
+          release(tile);
+        }
+      }
+      m_live.erase(live, m_live.end());
+    }
+
+    void release(Tile &t_tile) const
+    {
+      if (t_tile.pending)
+      {
+        m_loader->cancel(t_tile.filename);
+        t_tile.pending = false;
+      }
+
+      t_tile.backing.reset();
+      releaseBaked(t_tile);
+    }
+
+    static void releaseBaked(Tile &t_tile)
+    {
+      t_tile.baked.reset();
+      t_tile.shifted.clear();
+      t_tile.stale.clear();
+    }
+
+    mutable std::vector<Rect> m_dirty; // areas needing a rebake, in layer coordinates
+    bool m_bake_objects;
+    int m_subpixel_steps; // per pixel and direction, 1 when off
+
+    int m_width;
+    int m_height;
+    int m_tile_width;
+    int m_tile_height;
+    int m_columns;
+    int m_rows;
+
+    mutable std::vector<Tile> m_tiles;
+    mutable std::vector<int> m_live; // indexes of resident or pending tiles, chunked only
+    std::map<std::string, int> m_tile_index; // tile filename to index, chunked only
+
+    boost::shared_ptr<Tile_Set> m_tile_set; // NULL unless chunked
+    boost::shared_ptr<Background_Loader> m_loader; // NULL unless chunked
+
+    Object_Grid m_objects;
+    Entity_Store m_entities;
+};
+
+#endif
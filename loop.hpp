@@ -0,0 +1,167 @@
+#ifndef CHAIGAME_LOOP_HPP_
+#define CHAIGAME_LOOP_HPP_
+
+#include <SDL/SDL.h>
+#include <algorithm>
+#include <vector>
+
+#include "profiler.hpp"
+
+/// Paces the main loop: the simulation advances in fixed steps of real
+/// time however fast frames render, and rendering interpolates between the
+/// last two steps. Frames can be capped to a maximum rate, and the loop
+/// sleeps rather than spins while nothing is being presented.
+class Loop_Scheduler
+{
+  public:
+    Loop_Scheduler(double t_step)
+      : m_step(t_step), m_frame_time(0), m_now(currentTime()), m_simulated(m_now), m_frame_start(m_now)
+    {
+    }
+
+    /// Caps rendering at t_fps frames per second, 0 for no cap
+    void setFrameCap(double t_fps)
+    {
+      m_frame_time = t_fps > 0 ? 1 / t_fps : 0;
+    }
+
+    /// Starts a frame, returns how many simulation steps are due. Call
+    /// advance() after running each of them.
+    /// Falling far behind drops time instead of stalling on catch up steps.
+    int beginFrame()
+    {
+      m_now = currentTime();
+      m_frame_start = m_now;
+      m_simulated = std::max(m_simulated, m_now - m_step * max_steps);
+
+      return int((m_now - m_simulated) / m_step);
+    }
+
+    /// Clock time the next simulation step runs up to
+    double nextStepTime() const
+    {
+      return m_simulated + m_step;
+    }
+
+    void advance()
+    {
+      m_simulated += m_step;
+    }
+
+    /// Length of one simulation step in seconds
+    double step() const
+    {
+      return m_step;
+    }
+
+    /// How far, in steps, the frame being rendered lies past the last
+    /// simulation step
+    double alpha() const
+    {
+      return std::min(std::max((m_now - m_simulated) / m_step, 0.0), 1.0);
+    }
+
+    /// Sleeps until the next frame is due. An idle frame, one that
+    /// presented nothing, waits for the next simulation step since nothing
+    /// can change before then. A synced renderer already waited on present.
+    void endFrame(bool t_presented, bool t_synced)
+    {
+      double due = m_frame_start;
+
+      if (!t_presented)
+      {
+        due = nextStepTime();
+      } else if (m_frame_time > 0 && !t_synced) {
+        due = m_frame_start + m_frame_time;
+      }
+
+      const double remaining = due - currentTime();
+      if (remaining >= 0.001)
+      {
+        SDL_Delay(Uint32(remaining * 1000));
+      }
+    }
+
+  private:
+    static const int max_steps = 10;
+
+    double m_step;
+    double m_frame_time;
+    double m_now;
+    double m_simulated; // clock time the simulation has been stepped up to
+    double m_frame_start;
+};
+
+/// Fixed capacity ring of timestamped SDL events. Every pending event is
+/// drained into it each frame, and the simulation consumes them step by
+/// step, so a slow frame never leaves input queued inside SDL.
+class Input_Buffer
+{
+  public:
+    struct Event
+    {
+      double time;
+      SDL_Event event;
+    };
+
+    Input_Buffer(size_t t_capacity = 256)
+      : m_events(t_capacity), m_first(0), m_size(0), m_dropped(0)
+    {
+    }
+
+    /// Moves every pending SDL event into the buffer. If the buffer
+    /// overflows, the oldest events are dropped.
+    void poll()
+    {
+      const double now = currentTime();
+      SDL_Event e;
+
+      while (SDL_PollEvent(&e))
+      {
+        if (m_size == m_events.size())
+        {
+          m_first = (m_first + 1) % m_events.size();
+          --m_size;
+          ++m_dropped;
+        }
+
+        Event &event = m_events[(m_first + m_size) % m_events.size()];
+        event.time = now;
+        event.event = e;
+        ++m_size;
+      }
+    }
+
+    /// Takes the oldest event if it happened no later than t_until
+    bool next(double t_until, SDL_Event &t_event)
+    {
+      if (m_size == 0 || m_events[m_first].time > t_until)
+      {
+        return false;
+      }
+
+      t_event = m_events[m_first].event;
+      m_first = (m_first + 1) % m_events.size();
+      --m_size;
+      return true;
+    }
+
+    size_t size() const
+    {
+      return m_size;
+    }
+
+    /// Number of events lost to overflow so far
+    size_t dropped() const
+    {
+      return m_dropped;
+    }
+
+  private:
+    std::vector<Event> m_events;
+    size_t m_first;
+    size_t m_size;
+    size_t m_dropped;
+};
+
+#endif
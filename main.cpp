@@ -1,458 +1,748 @@
 #include <SDL/SDL.h>
-#include <SDL/SDL_image.h>
+#include <boost/function.hpp>
+#include <boost/ref.hpp>
 #include <boost/shared_ptr.hpp>
 #include <iostream>
+#include <fstream>
 #include <stdexcept>
+#include <string>
 #include <vector>
-#include <set>
-#include <utility>
+#include <cstdlib>
+
+#include "geometry.hpp"
+#include "profiler.hpp"
+#include "surface.hpp"
+#include "renderer.hpp"
+#include "screen.hpp"
+#include "asset_cache.hpp"
+#include "object.hpp"
+#include "sprite_atlas.hpp"
+#include "layer.hpp"
+#include "room.hpp"
+#include "room_pack.hpp"
+#include "script.hpp"
+#include "profile_overlay.hpp"
+#include "loop.hpp"
+#include "sim_pipeline.hpp"
+#include "replay.hpp"
+#include "world.hpp"
 
-class Surface;
-class Screen;
-class Position;
-class Room;
-class Layer;
-
-class Position
+struct State
 {
-  public:
-    Position(double t_x, double t_y)
-      : m_x(t_x), m_y(t_y)
-    {
-    }
-
-    const double &x() const
-    {
-      return m_x;
-    }
-
-    const double &y() const
-    {
-      return m_y;
-    }
-
-    double &x() 
-    {
-      return m_x;
-    }
+  Position p;
+  Position previous_p; // p as of the previous simulation step
 
-    double &y()
-    {
-      return m_y;
-    }
+  bool moving_left;
+  bool moving_right;
+  bool moving_up;
+  bool moving_down;
 
-    Position operator+(const Position &t_rhs) const
-    {
-      return Position(m_x + t_rhs.m_x, m_y + t_rhs.m_y);
-    }
+  bool report_due; // time for the frame rate report
 
-    bool operator<(const Position &t_rhs) const
-    {
-      return (m_y < t_rhs.m_y)
-        || (m_y == t_rhs.m_y && m_x < t_rhs.m_x);
-    }
 
-  private:
-    double m_x;
-    double m_y;
+  State()
+    : p(100, 100),
+      previous_p(p),
+      moving_left(false),
+      moving_right(false),
+      moving_up(false),
+      moving_down(false),
+      report_due(false)
+  {
+  }
 
+  /// Position t_alpha of the way from previous_p to p
+  Position interpolated(double t_alpha) const
+  {
+    return Position(previous_p.x() + (p.x() - previous_p.x()) * t_alpha,
+        previous_p.y() + (p.y() - previous_p.y()) * t_alpha);
+  }
 };
 
-class Surface
+void handleKey(State &t_state, SDL_KeyboardEvent t_key)
 {
-  public:
-    typedef char* (*ErrorFunc)();
+  bool keypressed = t_key.state == SDL_PRESSED;
 
-    Surface(SDL_Surface *t_surf)
-      : m_surface(t_surf)
-    {
-      if (!m_surface)
-      {
-        throw std::runtime_error(SDL_GetError());
-      }
-    }
+  switch (t_key.keysym.sym)
+  {
+    case SDLK_LEFT:
+      t_state.moving_left = keypressed;
+      break;
+    case SDLK_RIGHT:
+      t_state.moving_right = keypressed;
+      break;
+    case SDLK_UP:
+      t_state.moving_up = keypressed;
+      break;
+    case SDLK_DOWN:
+      t_state.moving_down = keypressed;
+      break;
 
-    Surface(SDL_Surface *t_surf, ErrorFunc t_errfunc)
-      : m_surface(t_surf)
-    {
-      if (!m_surface)
-      {
-        throw std::runtime_error(t_errfunc());
-      }
-    }
+    default:
 
-    void clear()
-    {
-      SDL_Rect dest;
-      dest.x=0;
-      dest.y=0;
-      dest.w=m_surface->w;
-      dest.h=m_surface->h;
-//      SDL_SetAlpha(m_surface, SDL_SRCALPHA, SDL_ALPHA_OPAQUE);
-      SDL_FillRect(m_surface, &dest, SDL_MapRGBA(m_surface->format, 0, 0, 0, SDL_ALPHA_TRANSPARENT));
-    }
+     ;
+  }
+}
 
-    void flip()
-    {
-      SDL_Flip(m_surface);
-    }
+/// Advances the simulation by one step of t_seconds
+void updateState(State &t_state, double t_seconds)
+{
+  t_state.previous_p = t_state.p;
 
-    ~Surface()
-    {
-      SDL_FreeSurface(m_surface);
-    }
+  if (t_state.moving_left)
+  {
+    t_state.p.x() -= 50 * t_seconds;
+  }
+  if (t_state.moving_right)
+  {
+    t_state.p.x() += 50 * t_seconds;
+  }
+  if (t_state.moving_up)
+  {
+    t_state.p.y() -= 50 * t_seconds;
+  }
+  if (t_state.moving_down)
+  {
+    t_state.p.y() += 50 * t_seconds;
+  }
+}
 
-    void render(Surface &t_surface, const Position &t_position) const
-    {
-      SDL_Rect dest;
-      dest.x = t_position.x();
-      dest.y = t_position.y();
-      dest.w = m_surface->w;
-      dest.h = m_surface->h;
+struct Quit_Exception : std::runtime_error
+{
+  Quit_Exception() throw()
+    : std::runtime_error("Quit Requested")
+  {
+  }
 
-      SDL_BlitSurface(m_surface, NULL, t_surface.m_surface, &dest);
-    }
+  virtual ~Quit_Exception() throw()
+  {
+  }
+};
 
-    double width() const
-    {
-      return m_surface->w;
-    }
+/// Applies one event to the simulation
+void handleSDLEvent(State &t_state, const SDL_Event &t_e)
+{
+  switch (t_e.type)
+  {
+    case SDL_KEYDOWN:
+    case SDL_KEYUP:
+      handleKey(t_state, t_e.key);
+      break;
+    case SDL_QUIT:
+      throw Quit_Exception();
+      break;
+    case SDL_USEREVENT:
+      t_state.report_due = true;
+      break;
+
+    default:
+      ;
+  }
+}
+
+/// Applies events to the simulation as step t_step of the frame, recording
+/// them to recorder unless it is NULL
+struct Event_Handler
+{
+  Event_Handler(State &t_state, Replay_Recorder *t_recorder, int t_step)
+    : state(t_state), recorder(t_recorder), step(t_step)
+  {
+  }
 
-    double height() const
+  void operator()(const SDL_Event &t_e)
+  {
+    if (recorder)
     {
-      return m_surface->h;
+      recorder->event(step, t_e);
     }
+    handleSDLEvent(state, t_e);
+  }
 
-  private:
-    SDL_Surface *m_surface;
+  State &state;
+  Replay_Recorder *recorder;
+  int step;
 };
 
-class Screen
+/// Applies the buffered events that happened no later than t_until. With
+/// t_keys false, key events are dropped, e.g. while a replay steers.
+void handleSDLEvents(Event_Handler &t_handler, Input_Buffer &t_input, double t_until, bool t_keys)
 {
-  public:
-    Screen()
-      : m_initializer(), m_surface(SDL_SetVideoMode(640, 480, 32, SDL_HWSURFACE | SDL_HWACCEL))
+  SDL_Event e;
+  while (t_input.next(t_until, e))
+  {
+    if (t_keys || (e.type != SDL_KEYDOWN && e.type != SDL_KEYUP))
     {
-
+      t_handler(e);
     }
+  }
+}
 
+/// Prints the frame rate from the frames presented since the last report,
+/// which is due every tenth of a second
+void report(int t_frames)
+{
+  const Profiler::Summary summary = profiler().summarize(60);
+  std::cout << "FPS: " << t_frames * 10
+    << " frame ms p50: " << summary.p50 * 1000 << " p99: " << summary.p99 * 1000
+    << " max: " << summary.max * 1000 << " blits: " << summary.blits
+    << " pixels: " << summary.pixels << '\n';
+}
 
-    Surface &getSurface()
-    {
-      return m_surface;
-    }
+/// The simulation steps due in a frame. Runs on the main thread, or on a
+/// Sim_Pipeline's thread while the previous frame renders; the profiler
+/// belongs to the main thread, so the steps are timed here and handed to it
+/// by profile() once they're done.
+/// The steps take their input from a replay if one is set, the live input
+/// only ending them early, and are recorded if a recorder is set.
+struct Simulation
+{
+  Simulation(Input_Buffer &t_input, Loop_Scheduler &t_scheduler, World &t_world)
+    : input(t_input), scheduler(t_scheduler), world(t_world), replay(0), recorder(0), steps(0), quit(false)
+  {
+  }
 
-  private:
-    struct Initializer
-    {
-      Initializer()
-      {
-        if ( SDL_Init(SDL_INIT_AUDIO|SDL_INIT_VIDEO|SDL_INIT_TIMER) < 0 ) {
-          throw std::runtime_error(std::string("Unable to init SDL: ") + SDL_GetError());
-        }
-      }
+  void run()
+  {
+    const int due = steps;
 
-      ~Initializer()
+    try {
+      for (; steps > 0; --steps)
       {
-        SDL_Quit();
+        const double start = currentTime();
+        Event_Handler handler(state, recorder, due - steps);
+        if (replay)
+        {
+          // playback isn't paced by the clock, the live events are all due
+          handleSDLEvents(handler, input, start, false);
+          replay->events(handler.step, handler);
+        } else {
+          handleSDLEvents(handler, input, scheduler.nextStepTime(), true);
+        }
+        const double events = currentTime();
+        updateState(state, scheduler.step());
+        world.room().update(scheduler.step());
+        if (hook)
+        {
+          hook(state, scheduler.step());
+        }
+        timings.push_back(Timing(Profiler::Events, start, events - start));
+        timings.push_back(Timing(Profiler::Update, events, currentTime() - events));
+        scheduler.advance();
       }
-    };
-
-    Initializer m_initializer;
-    Surface m_surface;
-};
+    } catch (const Quit_Exception &) {
+      quit = true;
+    }
 
-class Object
-{
-  public:
-    Object(const std::string &t_filename)
-      : m_surface(IMG_Load(t_filename.c_str()), &IMG_GetError)
+    if (recorder)
     {
+      recorder->endFrame(due, scheduler.alpha());
     }
+  }
+
+  /// For Sim_Pipeline
+  void operator()()
+  {
+    run();
+  }
 
-    ~Object()
+  /// Records the timings of the steps run since the last call
+  void profile()
+  {
+    for (std::vector<Timing>::const_iterator itr = timings.begin();
+         itr != timings.end();
+         ++itr)
     {
+      if (profiler().enabled())
+      {
+        profiler().record(itr->section, -1, itr->start, itr->duration);
+      }
     }
+    timings.clear();
+  }
 
-    void render(Surface &t_surface, Position t_position) const
+  struct Timing
+  {
+    Timing(Profiler::Section t_section, double t_start, double t_duration)
+      : section(t_section), start(t_start), duration(t_duration)
     {
-      m_surface.render(t_surface, t_position);
     }
 
+    Profiler::Section section;
+    double start;
+    double duration;
+  };
 
-  private:
-    Object(const Object &);
-    Object &operator=(const Object &);
-
-    Surface m_surface;
+  State state;
+  Input_Buffer &input;
+  Loop_Scheduler &scheduler;
+  World &world; // only its current room is stepped
+  boost::function<void (State &, double)> hook; // run after each step, if set
+  Replay_Player *replay; // steering the steps, if set
+  Replay_Recorder *recorder; // recording the steps, if set
+  int steps; // due in the next run
+  bool quit;
+  std::vector<Timing> timings;
 };
 
-class Layer
+uint32_t timerevent(uint32_t interval, void *)
 {
-  public:
-    Layer(const std::string &t_image)
-      : m_dirty(false), m_surface(IMG_Load(t_image.c_str()), &IMG_GetError),
-        m_rendered_surface(IMG_Load(t_image.c_str()), &IMG_GetError)
-    {
-    }
+  SDL_Event event;
+  event.type = SDL_USEREVENT;
+  SDL_PushEvent(&event);
 
-    void addObject(Position t_p, const boost::shared_ptr<Object> &t_obj)
-    {
-      m_objects.insert(std::make_pair(t_p, t_obj));
-      m_dirty = true;
-    }
+  return interval;
 
-    void render(Surface &t_surface, const Position &t_offset) const
-    {
-      if (m_dirty) 
-      {
-//        m_rendered_surface.clear();
-//        m_surface.render(m_rendered_surface, Position(0, 0));
- 
-        for (std::set<std::pair<Position, boost::shared_ptr<Object> > >::const_iterator itr = m_objects.begin();
-             itr != m_objects.end();
-             ++itr)
-        {
-          itr->second->render(m_rendered_surface, itr->first);
-        }
+}
 
-        m_dirty = false;
-      }
+#ifdef CHAIGAME_HAS_CHAISCRIPT
+/// Lets scripts read and steer the camera
+void addStateType(Script &t_script)
+{
+  chaiscript::ChaiScript &chai = t_script.engine();
+  chai.add(chaiscript::user_type<State>(), "State");
+  chai.add(chaiscript::fun(&State::p), "p");
+  chai.add(chaiscript::fun(&State::moving_left), "moving_left");
+  chai.add(chaiscript::fun(&State::moving_right), "moving_right");
+  chai.add(chaiscript::fun(&State::moving_up), "moving_up");
+  chai.add(chaiscript::fun(&State::moving_down), "moving_down");
+}
+#endif
 
-      m_rendered_surface.render(t_surface, t_offset);
-    }
+/// Parses WxH
+bool parseSize(const std::string &t_arg, int &t_width, int &t_height)
+{
+  const size_t x = t_arg.find('x');
+  if (x == std::string::npos)
+  {
+    return false;
+  }
 
-    double width() const
-    {
-      return m_surface.width();
-    }
+  t_width = atoi(t_arg.substr(0, x).c_str());
+  t_height = atoi(t_arg.substr(x + 1).c_str());
+  return t_width >= 0 && t_height >= 0;
+}
 
-    double height() const
-    {
-      return m_surface.height();
-    }
+/// Lays out the room from its images, decoding them in the background if
+/// t_async, with the sprites packed onto t_atlas unless it is NULL. Returns
+/// the layer the camera follows.
+boost::shared_ptr<Layer> buildRoom(Room &t_room, Asset_Cache &t_assets, Sprite_Atlas *t_atlas, bool t_async,
+    int t_subpixel_steps)
+{
+  const boost::shared_ptr<const Surface> clouds_image = t_async?t_assets.request("clouds.png"):t_assets.get("clouds.png");
+  const boost::shared_ptr<const Surface> play_image = t_async?t_assets.request("play.png"):t_assets.get("play.png");
+  const boost::shared_ptr<const Surface> cloud_image = t_async?t_assets.request("cloud.png", true):t_assets.get("cloud.png", true);
+  const boost::shared_ptr<const Surface> tree_image = t_async?t_assets.request("tree.png", true):t_assets.get("tree.png", true);
+
+  boost::shared_ptr<Layer> clouds(new Layer(clouds_image));
+  boost::shared_ptr<Layer> play(new Layer(play_image));
+  const boost::shared_ptr<Object> o1 = t_atlas?t_atlas->add(cloud_image):boost::shared_ptr<Object>(new Object(cloud_image));
+  const boost::shared_ptr<Object> o2 = t_atlas?t_atlas->add(tree_image):boost::shared_ptr<Object>(new Object(tree_image));
+  play->setSubpixelSteps(t_subpixel_steps);
+  clouds->setSubpixelSteps(t_subpixel_steps);
+  t_room.addLayer(play);
+  play->addObject(Position(45, 100), o2);
+  play->addObject(Position(60, 300), o2);
+  play->addObject(Position(600, 800), o2);
+  play->addObject(Position(200, 800), o2);
 
+  t_room.addLayer(clouds);
+  clouds->addObject(Position(10, 10), o1);
+  clouds->addObject(Position(100, 10), o1);
+  clouds->addObject(Position(300, 10), o1);
+  clouds->addObject(Position(10, 400), o1);
 
-  private:
-    mutable bool m_dirty;
+  return play;
+}
 
-    Surface m_surface; // cached surface
+/// World::Builder for the room laid out by buildRoom()
+struct Sample_Builder
+{
+  Sample_Builder(Sprite_Atlas *t_atlas, bool t_async, int t_subpixel_steps)
+    : atlas(t_atlas), async(t_async), subpixel_steps(t_subpixel_steps)
+  {
+  }
 
-    mutable Surface m_rendered_surface; // cached surface
+  boost::shared_ptr<Layer> operator()(Room &t_room, Asset_Cache &t_assets) const
+  {
+    return buildRoom(t_room, t_assets, atlas, async, subpixel_steps);
+  }
 
-    std::set<std::pair<Position, boost::shared_ptr<Object> > > m_objects;
+  Sprite_Atlas *atlas;
+  bool async;
+  int subpixel_steps;
 };
 
-
-class Room
+/// World::Builder for a room read from a Room_Pack
+struct Pack_Builder
 {
-  public:
+  explicit Pack_Builder(const std::string &t_filename)
+    : filename(t_filename)
+  {
+  }
 
-    void addLayer(const boost::shared_ptr<Layer> &t_layer)
-    {
-      m_layers.push_back(t_layer);
-    }
+  boost::shared_ptr<Layer> operator()(Room &t_room, Asset_Cache &) const
+  {
+    Room_Pack pack(filename);
+    pack.addTo(t_room);
+    std::cout << "Room pack: " << pack.layers().size() << " layers, " << pack.mappedBytes() << " bytes mapped, "
+      << pack.converted() << " images converted" << std::endl;
+    return pack.layers().at(0);
+  }
 
-    void render(Surface &t_surface, const boost::shared_ptr<Layer> &t_center_layer,
-        const Position &t_pos_on_layer) const
-    {
+  std::string filename;
+};
 
-      std::vector<boost::shared_ptr<Layer> >::const_iterator foundlayer = 
-        std::find(m_layers.begin(), m_layers.end(), t_center_layer);
+int main(int argc, char *argv[])
+{
+  Screen::Backend backend = Screen::OpenGL;
+  int render_threads = 1;
+  Video_Mode mode;
+  int subpixel_steps = 1;
+  Loop_Scheduler scheduler(1.0 / 120);
+  bool profile_overlay = false;
+  std::string profile_csv;
+  std::string profile_trace;
+  std::string room_pack;
+  std::string write_pack;
+  std::string script_file;
+  bool watch_assets = false;
+  bool pipelined = false;
+  std::string record_file;
+  std::string replay_file;
+  bool headless = false;
+  size_t memory_budget = 0;
+  int world_columns = 1;
+  int world_rows = 1;
+
+  for (int i = 1; i < argc; ++i)
+  {
+    const std::string arg(argv[i]);
 
-      if (foundlayer == m_layers.end())
+    if (arg == "--software")
+    {
+      backend = Screen::Software;
+    } else if (arg == "--size" && i + 1 < argc) {
+      if (!parseSize(argv[++i], mode.width, mode.height))
       {
-        throw std::runtime_error("Requested center layer doesn't exist in room");
+        std::cerr << "Invalid size: " << argv[i] << std::endl;
+        return 1;
       }
-
-      double xpercent = double(t_pos_on_layer.x()) / (*foundlayer)->width();
-      double ypercent = double(t_pos_on_layer.y()) / (*foundlayer)->height();
-
-      double renderwidth = t_surface.width();
-      double renderheight = t_surface.height();
-
-      for (std::vector<boost::shared_ptr<Layer> >::const_iterator itr = m_layers.begin();
-           itr != m_layers.end();
-           ++itr)
+    } else if (arg == "--internal-size" && i + 1 < argc) {
+      if (!parseSize(argv[++i], mode.internal_width, mode.internal_height))
       {
-        double xcenter = (*itr)->width() * xpercent;
-        double ycenter = (*itr)->height() * ypercent;
-
-        double xoffset = -xcenter + renderwidth / 2;
-        double yoffset = -ycenter + renderheight / 2;
-
-        (*itr)->render(t_surface, Position(xoffset, yoffset));
+        std::cerr << "Invalid size: " << argv[i] << std::endl;
+        return 1;
       }
-
-      t_surface.flip();
+    } else if (arg == "--bpp" && i + 1 < argc) {
+      mode.bpp = atoi(argv[++i]);
+    } else if (arg == "--fullscreen") {
+      mode.fullscreen = true;
+    } else if (arg == "--double-buffer") {
+      mode.double_buffered = true;
+    } else if (arg == "--render-threads" && i + 1 < argc) {
+      render_threads = atoi(argv[++i]);
+    } else if (arg == "--subpixel" && i + 1 < argc) {
+      subpixel_steps = atoi(argv[++i]);
+    } else if (arg == "--max-fps" && i + 1 < argc) {
+      scheduler.setFrameCap(atof(argv[++i]));
+    } else if (arg == "--profile-overlay") {
+      profile_overlay = true;
+    } else if (arg == "--profile-csv" && i + 1 < argc) {
+      profile_csv = argv[++i];
+    } else if (arg == "--profile-trace" && i + 1 < argc) {
+      profile_trace = argv[++i];
+    } else if (arg == "--pack" && i + 1 < argc) {
+      room_pack = argv[++i];
+    } else if (arg == "--write-pack" && i + 1 < argc) {
+      write_pack = argv[++i];
+    } else if (arg == "--watch") {
+      watch_assets = true;
+    } else if (arg == "--pipeline") {
+      pipelined = true;
+    } else if (arg == "--record" && i + 1 < argc) {
+      record_file = argv[++i];
+    } else if (arg == "--replay" && i + 1 < argc) {
+      replay_file = argv[++i];
+    } else if (arg == "--headless") {
+      headless = true;
+    } else if (arg == "--world" && i + 1 < argc) {
+      if (!parseSize(argv[++i], world_columns, world_rows) || world_columns < 1 || world_rows < 1)
+      {
+        std::cerr << "Invalid world size: " << argv[i] << std::endl;
+        return 1;
+      }
+    } else if (arg == "--memory-budget" && i + 1 < argc) {
+      // in MB
+      memory_budget = size_t(atof(argv[++i]) * 1024 * 1024);
+    } else if (arg == "--script" && i + 1 < argc) {
+      script_file = argv[++i];
     }
+  }
 
-  private:
-    std::vector<boost::shared_ptr<Layer> > m_layers;
+  boost::shared_ptr<Replay_Player> replay;
+  if (!replay_file.empty())
+  {
+    replay.reset(new Replay_Player(replay_file));
+    // stepped as recorded, and every frame of it kept for the profile
+    scheduler = Loop_Scheduler(replay->step());
+    profiler().setHistory(replay->length());
+  }
 
-};
+  if (headless)
+  {
+    // rendered in software, off screen
+    if (!SDL_getenv("SDL_VIDEODRIVER"))
+    {
+      SDL_putenv(const_cast<char *>("SDL_VIDEODRIVER=dummy"));
+    }
+    backend = Screen::Software;
+  }
 
+  surfaceMemory().setBudget(memory_budget);
+  Screen s(backend, render_threads, mode);
 
-struct State
-{
-  Position p;
+  if (profile_overlay)
+  {
+    s.getRenderer().setOverlay(boost::shared_ptr<Overlay>(new Profile_Overlay()));
+  }
 
-  bool moving_left;
-  bool moving_right;
-  bool moving_up;
-  bool moving_down;
+  Asset_Cache assets;
+  Sprite_Atlas atlas;
 
-  double s_per_frame;
+  World::Builder build;
 
-  int frame_count;
+#ifdef CHAIGAME_HAS_CHAISCRIPT
+  boost::shared_ptr<Script> script;
+  boost::function<void (State &, double)> update_hook;
 
+  if (!script_file.empty())
+  {
+    script.reset(new Script(script_file));
+    addStateType(*script);
 
-  State()
-    : p(100, 100),
-      moving_left(false),
-      moving_right(false),
-      moving_up(false),
-      moving_down(false),
-      s_per_frame(.03),
-      frame_count(0)
+    // resolved once here, called every step
+    update_hook = script->hook<void (State &, double)>("update");
+    build = script->hook<boost::shared_ptr<Layer> (Room &, Asset_Cache &)>("setup");
+  }
+#else
+  if (!script_file.empty())
   {
+    std::cerr << "Built without ChaiScript, ignoring " << script_file << std::endl;
   }
-};
+#endif
 
-void handleKey(State &t_state, SDL_KeyboardEvent t_key)
-{
-  bool keypressed = t_key.state == SDL_PRESSED;
-
-  switch (t_key.keysym.sym)
+  if (build)
   {
-    case SDLK_LEFT:
-      t_state.moving_left = keypressed;
-      break;
-    case SDLK_RIGHT:
-      t_state.moving_right = keypressed;
-      break;
-    case SDLK_UP:
-      t_state.moving_up = keypressed;
-      break;
-    case SDLK_DOWN:
-      t_state.moving_down = keypressed;
-      break;
-
-    default:
-
-     ;
+    // laid out by the script
+  } else if (!room_pack.empty()) {
+    build = Pack_Builder(room_pack);
+  } else {
+    // a pack has to be written from the decoded images, not placeholders
+    // Sprites share textures on the GPU. The software renderers are better
+    // off blitting each from its own small surface, whose rows are
+    // contiguous, than from a wide page.
+    // A replay loads everything up front, so images finishing in the
+    // background don't change what its frames cost.
+    build = Sample_Builder(s.backend() == Screen::OpenGL?&atlas:0, write_pack.empty() && !replay, subpixel_steps);
   }
-}
 
-void updateState(State &t_state)
-{
-  if (t_state.moving_left)
+  // The first room is built right away, the others of a --world grid,
+  // copies of it side by side, once the player gets close
+  boost::shared_ptr<Room> first(new Room());
+  const boost::shared_ptr<Layer> play = build(*first, assets);
+  if (!play)
   {
-    t_state.p.x() -= 50 * t_state.s_per_frame;
+    throw std::runtime_error("Room builder returned no center layer");
   }
-  if (t_state.moving_right)
+
+  if (!write_pack.empty())
   {
-    t_state.p.x() += 50 * t_state.s_per_frame;
+    Room_Pack::write(write_pack, *first);
   }
-  if (t_state.moving_up)
+
+  World world(assets);
+  const int room_width = int(play->width());
+  const int room_height = int(play->height());
+  world.addRoom(Rect(0, 0, room_width, room_height), build, first, play);
+  for (int row = 0; row < world_rows; ++row)
   {
-    t_state.p.y() -= 50 * t_state.s_per_frame;
+    for (int column = 0; column < world_columns; ++column)
+    {
+      if (row > 0 || column > 0)
+      {
+        world.addRoom(Rect(column * room_width, row * room_height, room_width, room_height), build);
+      }
+    }
   }
-  if (t_state.moving_down)
+
+  world.setDirtyRectUpdates(true);
+
+  std::cout << "Assets: " << assets.size() << " resident, " << assets.residentBytes() << " bytes, "
+    << assets.hits() << " hits, " << assets.misses() << " misses, " << assets.pending() << " loading" << std::endl;
+  if (atlas.pages() > 0)
   {
-    t_state.p.y() += 50 * t_state.s_per_frame;
+    std::cout << "Atlas: " << atlas.sprites() << " sprites on " << atlas.pages() << " pages, "
+      << atlas.bytes() << " bytes" << std::endl;
   }
-}
+  surfaceMemory().write(std::cout);
+  std::cout << std::endl;
 
-struct Quit_Exception : std::runtime_error
-{
-  Quit_Exception() throw()
-    : std::runtime_error("Quit Requested")
+  Input_Buffer input;
+  std::vector<const Surface *> loaded;
+  double next_watch = 0;
+  int frame_count = 0;
+  bool over_budget = false; // even after releasing what could be
+
+  Simulation sim(input, scheduler, world);
+  boost::shared_ptr<Sim_Pipeline> pipeline;
+  boost::shared_ptr<Replay_Recorder> recorder;
+
+  if (!record_file.empty())
   {
+    recorder.reset(new Replay_Recorder(record_file, scheduler.step()));
+    sim.recorder = recorder.get();
   }
+  sim.replay = replay.get();
+#ifdef CHAIGAME_HAS_CHAISCRIPT
+  sim.hook = update_hook;
+#endif
 
-  virtual ~Quit_Exception() throw()
+  if (pipelined && sim.hook)
   {
+    // the hook may change any layer, so it can't run alongside rendering
+    std::cerr << "Script update hooks can't be pipelined, simulating on the main thread" << std::endl;
+  } else if (pipelined) {
+    world.setBufferedEntities(true);
+    pipeline.reset(new Sim_Pipeline(boost::ref(sim)));
   }
-};
 
-void handleSDLEvents(State &t_state)
-{
-  SDL_Event e;
-  if (SDL_PollEvent(&e))
+  State shown; // as rendered
+  SDL_AddTimer(100, &timerevent, 0);
+
+  while (!sim.quit)
   {
-    switch (e.type)
+    // everything up to rendering runs while the simulation, if pipelined,
+    // is waiting
+    input.poll();
+
+    if (sim.state.report_due)
     {
-      case SDL_KEYDOWN:
-      case SDL_KEYUP:
-        handleKey(t_state, e.key);
-        break;
-      case SDL_QUIT:
-        throw Quit_Exception();
-        break;
-      case SDL_USEREVENT:
-        t_state.s_per_frame = 1 / (double(t_state.frame_count) * 10);
-        std::cout << "FPS: " << t_state.frame_count * 10 << std::endl << std::flush;
-        t_state.frame_count = 0;
-        break;
-
-      default:
-        ;
+      report(frame_count);
+      frame_count = 0;
+      sim.state.report_due = false;
     }
-  }
-}
 
-uint32_t timerevent(uint32_t interval, void *)
-{
-  SDL_Event event;
-  event.type = SDL_USEREVENT;
-  SDL_PushEvent(&event);
+    // edited image files are picked up by polling, cheaply, a few times a second
+    if (watch_assets && currentTime() >= next_watch)
+    {
+      assets.reloadChanged();
+      next_watch = currentTime() + 0.25;
+    }
 
-  return interval;
+    // images finishing in the background replace their placeholders here,
+    // between frames
+    loaded.clear();
+    if (assets.publish(loaded) > 0)
+    {
+      atlas.surfacesChanged(loaded);
+      world.surfacesChanged(loaded);
+    }
 
-}
+    double alpha = 0;
 
-int main()
-{
-  Screen s;
+    if (pipeline)
+    {
+      // render what was simulated last frame, while this frame's steps run
+      shown = sim.state;
+      alpha = replay?replay->alpha():scheduler.alpha();
+      world.room().publishEntities();
+    }
 
-  State state;
+    sim.steps = replay?replay->beginFrame():scheduler.beginFrame();
 
-  Room r1;
-  boost::shared_ptr<Layer> clouds(new Layer("clouds.png"));
-  boost::shared_ptr<Layer> play(new Layer("play.png"));
-  boost::shared_ptr<Object> o1(new Object("cloud.png"));
-  boost::shared_ptr<Object> o2(new Object("tree.png"));
-  r1.addLayer(play);
-  play->addObject(Position(45, 100), o2);
-  play->addObject(Position(60, 300), o2);
-  play->addObject(Position(600, 800), o2);
-  play->addObject(Position(200, 800), o2);
+    if (replay && replay->finished())
+    {
+      break;
+    }
 
-  r1.addLayer(clouds);
-  clouds->addObject(Position(10, 10), o1);
-  clouds->addObject(Position(100, 10), o1);
-  clouds->addObject(Position(300, 10), o1);
-  clouds->addObject(Position(10, 400), o1);
+    if (pipeline)
+    {
+      pipeline->start();
+    } else {
+      sim.run();
+      shown = sim.state;
+      alpha = replay?replay->alpha():scheduler.alpha();
+    }
 
-  bool cont = true;
-  SDL_AddTimer(100, &timerevent, 0);
+    const bool presented = world.room().render(s.getRenderer(), world.centerLayer(), shown.interpolated(alpha));
 
-  while (cont)
-  {
-    try {
-      handleSDLEvents(state);
-      updateState(state);
-    } catch (const Quit_Exception &) {
-      cont = false;
+    if (pipeline)
+    {
+      pipeline->finish();
     }
 
-    s.getSurface().clear();
-    r1.render(s.getSurface(), play, state.p);
+    sim.profile();
+
+    // Enters the room the player walked into, positions move over to it.
+    // Rooms ahead are built and baked a little every frame.
+    const Position shift = world.update(sim.state.p,
+        Position(sim.state.p.x() - sim.state.previous_p.x(), sim.state.p.y() - sim.state.previous_p.y()));
+    sim.state.p = sim.state.p + shift;
+    sim.state.previous_p = sim.state.previous_p + shift;
 
-    ++state.frame_count;
+    // over budget, give up what the next frames can rebuild
+    if (surfaceMemory().overBudget())
+    {
+      world.releaseCaches();
+      assets.evictUnused();
+
+      if (surfaceMemory().overBudget() && !over_budget)
+      {
+        std::cerr << "Surface memory stays over budget: " << surfaceMemory().total() << " bytes" << std::endl;
+      }
+      over_budget = surfaceMemory().overBudget();
+    }
+
+    if (presented)
+    {
+      ++frame_count;
+    }
+
+    profiler().endFrame();
+
+    // replays run as fast as they render
+    if (!replay)
+    {
+      scheduler.endFrame(presented, s.getRenderer().synced());
+    }
   }
 
-}
+  if (replay)
+  {
+    const Profiler::Summary summary = profiler().summarize(profiler().frames());
+    std::cout << "Replay: " << replay->frames() << " of " << replay->length() << " frames, frame ms p50: "
+      << summary.p50 * 1000 << " p99: " << summary.p99 * 1000 << " max: " << summary.max * 1000
+      << " blits: " << summary.blits << " pixels: " << summary.pixels << std::endl;
+  }
+
+  surfaceMemory().write(std::cout);
+  std::cout << std::endl;
+  if (world.size() > 1)
+  {
+    std::cout << "World: " << world.size() << " rooms, " << world.resident() << " resident, "
+      << world.prefetched() << " prefetched, " << world.missed() << " built on entry" << std::endl;
+  }
+
+  if (!profile_csv.empty())
+  {
+    std::ofstream csv(profile_csv.c_str());
+    profiler().writeCSV(csv);
+  }
 
+  if (!profile_trace.empty())
+  {
+    std::ofstream trace(profile_trace.c_str());
+    profiler().writeTrace(trace);
+  }
 
+}
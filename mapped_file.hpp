@@ -0,0 +1,108 @@
+#ifndef CHAIGAME_MAPPED_FILE_HPP_
+#define CHAIGAME_MAPPED_FILE_HPP_
+
+#include <stdexcept>
+#include <string>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/// A whole file mapped into memory, copy-on-write: pages are only read from
+/// disk when first touched, and writing to them never changes the file
+class Mapped_File
+{
+  public:
+    explicit Mapped_File(const std::string &t_filename)
+      : m_data(0), m_size(0)
+    {
+#ifdef _WIN32
+      HANDLE file = CreateFileA(t_filename.c_str(), GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING,
+          FILE_ATTRIBUTE_NORMAL, 0);
+
+      if (file == INVALID_HANDLE_VALUE)
+      {
+        throw std::runtime_error("Unable to open file: " + t_filename);
+      }
+
+      LARGE_INTEGER size;
+      HANDLE mapping = 0;
+
+      if (GetFileSizeEx(file, &size) && size.QuadPart > 0)
+      {
+        mapping = CreateFileMappingA(file, 0, PAGE_WRITECOPY, 0, 0, 0);
+      }
+
+      CloseHandle(file);
+
+      if (!mapping)
+      {
+        throw std::runtime_error("Unable to map file: " + t_filename);
+      }
+
+      m_data = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+      CloseHandle(mapping);
+      m_size = size_t(size.QuadPart);
+#else
+      const int file = open(t_filename.c_str(), O_RDONLY);
+
+      if (file < 0)
+      {
+        throw std::runtime_error("Unable to open file: " + t_filename);
+      }
+
+      struct stat info;
+
+      if (fstat(file, &info) == 0 && info.st_size > 0)
+      {
+        m_size = size_t(info.st_size);
+        m_data = mmap(0, m_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0);
+
+        if (m_data == MAP_FAILED)
+        {
+          m_data = 0;
+        }
+      }
+
+      close(file);
+#endif
+
+      if (!m_data)
+      {
+        throw std::runtime_error("Unable to map file: " + t_filename);
+      }
+    }
+
+    ~Mapped_File()
+    {
+#ifdef _WIN32
+      UnmapViewOfFile(m_data);
+#else
+      munmap(m_data, m_size);
+#endif
+    }
+
+    void *data() const
+    {
+      return m_data;
+    }
+
+    size_t size() const
+    {
+      return m_size;
+    }
+
+  private:
+    Mapped_File(const Mapped_File &);
+    Mapped_File &operator=(const Mapped_File &);
+
+    void *m_data;
+    size_t m_size;
+};
+
+#endif
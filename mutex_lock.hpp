@@ -0,0 +1,28 @@
+#ifndef CHAIGAME_MUTEX_LOCK_HPP_
+#define CHAIGAME_MUTEX_LOCK_HPP_
+
+#include <SDL/SDL.h>
+
+/// Scoped SDL_mutex lock
+class Mutex_Lock
+{
+  public:
+    Mutex_Lock(SDL_mutex *t_mutex)
+      : m_mutex(t_mutex)
+    {
+      SDL_LockMutex(m_mutex);
+    }
+
+    ~Mutex_Lock()
+    {
+      SDL_UnlockMutex(m_mutex);
+    }
+
+  private:
+    Mutex_Lock(const Mutex_Lock &);
+    Mutex_Lock &operator=(const Mutex_Lock &);
+
+    SDL_mutex *m_mutex;
+};
+
+#endif
@@ -0,0 +1,434 @@
+#ifndef CHAIGAME_OBJECT_HPP_
+#define CHAIGAME_OBJECT_HPP_
+
+#include <boost/shared_ptr.hpp>
+#include <algorithm>
+#include <map>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "geometry.hpp"
+#include "handle_table.hpp"
+#include "surface.hpp"
+
+/// An image placed on layers, either all of a surface or, for sprites
+/// packed by a Sprite_Atlas, a part of a shared page
+class Object
+{
+  public:
+    Object(const boost::shared_ptr<const Surface> &t_surface)
+      : m_surface(t_surface), m_area(0, 0, 0, 0)
+    {
+      m_surface->setCategory(Surface_Memory::Sprite);
+    }
+
+    /// Draws only t_area of t_surface
+    Object(const boost::shared_ptr<const Surface> &t_surface, const Rect &t_area)
+      : m_surface(t_surface), m_area(t_area)
+    {
+      if (m_area.empty() || !(m_area.intersect(t_surface->bounds()) == m_area))
+      {
+        throw std::runtime_error("Object area doesn't lie within its surface");
+      }
+      m_surface->setCategory(Surface_Memory::Sprite);
+    }
+
+    ~Object()
+    {
+    }
+
+    void render(Surface &t_surface, Position t_position) const
+    {
+      m_surface->render(t_surface, t_position, area());
+    }
+
+    /// Renders only the t_source part of the object's image
+    void render(Surface &t_surface, Position t_position, const Rect &t_source) const
+    {
+      const Rect image = area();
+      m_surface->render(t_surface, t_position, t_source.translate(image.x(), image.y()).intersect(image));
+    }
+
+    /// The surface the object's image is drawn from, shared with other
+    /// objects when packed into an atlas
+    const Surface &surface() const
+    {
+      return *m_surface;
+    }
+
+    /// The part of surface() holding the object's image
+    Rect area() const
+    {
+      return m_area.empty()?m_surface->bounds():m_area;
+    }
+
+    /// Area covered by the object when placed at t_position
+    Rect bounds(const Position &t_position) const
+    {
+      const Rect image = area();
+      return Rect(int(t_position.x()), int(t_position.y()), image.w(), image.h());
+    }
+
+
+  private:
+    friend class Sprite_Atlas;
+
+    Object(const Object &);
+    Object &operator=(const Object &);
+
+    boost::shared_ptr<const Surface> m_surface;
+    Rect m_area; // empty for all of m_surface, which may change size when reloaded
+};
+
+/// Refers to one placement of an object on a layer, stays valid until that
+/// placement is removed. 0 never refers to anything, see Handle_Table.
+typedef unsigned Object_Handle;
+
+/// Uniform grid over the objects placed on a layer, so the objects in an
+/// area can be found without visiting all of them.
+/// Placements are stored densely and refer to their object by an id into
+/// the grid's table of distinct objects, so placing one costs no allocation
+/// and no reference counting once the arrays have grown. Cells only hold
+/// indexes into the placements; an object spanning several cells is listed
+/// in each. The table holds each object only while it is placed.
+class Object_Grid
+{
+  public:
+    struct Placement
+    {
+      /// Hidden placements are kept but not found by query()
+      enum Flags
+      {
+        Hidden = 1
+      };
+
+      Placement(const Position &t_position, const Object *t_object, unsigned t_sprite,
+          unsigned t_flags, Object_Handle t_handle)
+        : position(t_position), bounds(t_object->bounds(t_position)), object(t_object),
+          sprite(t_sprite), flags(t_flags), handle(t_handle), visited(0)
+      {
+      }
+
+      /// Paint order: top to bottom, then left to right
+      bool operator<(const Placement &t_rhs) const
+      {
+        return position < t_rhs.position
+          || (position == t_rhs.position && sprite < t_rhs.sprite);
+      }
+
+      Position position;
+      Rect bounds;
+      const Object *object; // owned by the grid's object table
+      unsigned sprite; // id of object in that table
+      unsigned flags;
+      Object_Handle handle;
+      mutable unsigned visited; // last query that saw this placement
+    };
+
+    Object_Grid(int t_width, int t_height, int t_cell_size = 256)
+      : m_cell_size(t_cell_size),
+        m_columns(std::max((t_width + t_cell_size - 1) / t_cell_size, 1)),
+        m_rows(std::max((t_height + t_cell_size - 1) / t_cell_size, 1)),
+        m_cells(m_columns * m_rows), m_query(0)
+    {
+    }
+
+    /// Makes room for t_count placements, for bulk loading
+    void reserve(size_t t_count)
+    {
+      m_placements.reserve(t_count);
+      m_handles.reserve(t_count);
+    }
+
+    /// Returns the handle of the existing placement if the object is
+    /// already placed at t_position
+    Object_Handle insert(const Position &t_position, const boost::shared_ptr<Object> &t_object, unsigned t_flags = 0)
+    {
+      const unsigned sprite = spriteId(t_object);
+      const size_t existing = find(t_position, sprite);
+
+      if (existing != npos)
+      {
+        return m_placements[existing].handle;
+      }
+
+      const size_t index = m_placements.size();
+      m_placements.push_back(Placement(t_position, t_object.get(), sprite, t_flags, m_handles.add(index)));
+      ++m_sprite_uses[sprite];
+      forCells(m_placements.back().bounds, Add(index));
+      return m_placements.back().handle;
+    }
+
+    /// Returns false if the handle no longer refers to a placement
+    bool remove(Object_Handle t_handle)
+    {
+      const size_t index = indexOf(t_handle);
+
+      if (index == npos)
+      {
+        return false;
+      }
+
+      forCells(m_placements[index].bounds, Remove(index));
+      const unsigned sprite = m_placements[index].sprite;
+
+      // keep the placements dense by moving the last one into the gap
+      const size_t last = m_placements.size() - 1;
+      if (index != last)
+      {
+        forCells(m_placements[last].bounds, Renumber(last, index));
+        m_placements[index] = m_placements[last];
+        m_handles.move(m_placements[index].handle, index);
+      }
+      m_placements.pop_back();
+      m_handles.remove(t_handle);
+      release(sprite);
+
+      return true;
+    }
+
+    /// Returns false if the object is not placed at t_position
+    bool remove(const Position &t_position, const boost::shared_ptr<Object> &t_object)
+    {
+      const size_t index = find(t_position, t_object);
+      return index != npos && remove(m_placements[index].handle);
+    }
+
+    /// Returns false if the handle no longer refers to a placement
+    bool move(Object_Handle t_handle, const Position &t_position)
+    {
+      const size_t index = indexOf(t_handle);
+
+      if (index == npos)
+      {
+        return false;
+      }
+
+      Placement &placement = m_placements[index];
+      forCells(placement.bounds, Remove(index));
+      placement.position = t_position;
+      placement.bounds = placement.object->bounds(t_position);
+      forCells(placement.bounds, Add(index));
+      return true;
+    }
+
+    /// Returns false if the handle no longer refers to a placement
+    bool setFlags(Object_Handle t_handle, unsigned t_flags)
+    {
+      const size_t index = indexOf(t_handle);
+
+      if (index == npos)
+      {
+        return false;
+      }
+
+      m_placements[index].flags = t_flags;
+      return true;
+    }
+
+    /// NULL if the handle no longer refers to a placement. Valid until the
+    /// grid is next modified.
+    const Placement *get(Object_Handle t_handle) const
+    {
+      const size_t index = indexOf(t_handle);
+      return index == npos?0:&m_placements[index];
+    }
+
+    /// Appends the visible placements overlapping t_area to t_found, in
+    /// paint order. The pointers are valid until the grid is next modified.
+    void query(const Rect &t_area, std::vector<const Placement *> &t_found) const
+    {
+      const size_t first = t_found.size();
+      ++m_query;
+
+      for (int row = row_of(t_area.y()); row <= row_of(t_area.bottom() - 1); ++row)
+      {
+        for (int column = column_of(t_area.x()); column <= column_of(t_area.right() - 1); ++column)
+        {
+          const std::vector<unsigned> &cell = m_cells[row * m_columns + column];
+          for (std::vector<unsigned>::const_iterator itr = cell.begin();
+               itr != cell.end();
+               ++itr)
+          {
+            const Placement &placement = m_placements[*itr];
+            if (placement.visited != m_query && !(placement.flags & Placement::Hidden)
+                && placement.bounds.intersects(t_area))
+            {
+              placement.visited = m_query;
+              t_found.push_back(&placement);
+            }
+          }
+        }
+      }
+
+      std::sort(t_found.begin() + first, t_found.end(), Paint_Order());
+    }
+
+    size_t size() const
+    {
+      return m_placements.size();
+    }
+
+    /// Every placement, in no particular order
+    const std::vector<Placement> &placements() const
+    {
+      return m_placements;
+    }
+
+  private:
+    static const size_t npos = Handle_Table::npos;
+
+    size_t indexOf(Object_Handle t_handle) const
+    {
+      return m_handles.index(t_handle);
+    }
+
+    /// Registers t_object on first use, reusing the id of one no longer
+    /// placed
+    unsigned spriteId(const boost::shared_ptr<Object> &t_object)
+    {
+      std::map<const Object *, unsigned>::const_iterator itr = m_sprite_ids.find(t_object.get());
+
+      if (itr != m_sprite_ids.end())
+      {
+        return itr->second;
+      }
+
+      unsigned id;
+      if (m_free_sprites.empty())
+      {
+        id = unsigned(m_sprites.size());
+        m_sprites.push_back(t_object);
+        m_sprite_uses.push_back(0);
+      } else {
+        id = m_free_sprites.back();
+        m_free_sprites.pop_back();
+        m_sprites[id] = t_object;
+      }
+
+      m_sprite_ids.insert(std::make_pair(t_object.get(), id));
+      return id;
+    }
+
+    /// Drops one placement of sprite t_id, and with the last one the
+    /// grid's reference to the object, so its image can be freed
+    void release(unsigned t_id)
+    {
+      if (--m_sprite_uses[t_id] == 0)
+      {
+        m_sprite_ids.erase(m_sprites[t_id].get());
+        m_sprites[t_id].reset();
+        m_free_sprites.push_back(t_id);
+      }
+    }
+
+    struct Paint_Order
+    {
+      bool operator()(const Placement *t_lhs, const Placement *t_rhs) const
+      {
+        return *t_lhs < *t_rhs;
+      }
+    };
+
+    struct Add
+    {
+      Add(size_t t_index) : index(unsigned(t_index)) {}
+      void operator()(std::vector<unsigned> &t_cell) const { t_cell.push_back(index); }
+      unsigned index;
+    };
+
+    struct Remove
+    {
+      Remove(size_t t_index) : index(unsigned(t_index)) {}
+      void operator()(std::vector<unsigned> &t_cell) const
+      {
+        t_cell.erase(std::remove(t_cell.begin(), t_cell.end(), index), t_cell.end());
+      }
+      unsigned index;
+    };
+
+    struct Renumber
+    {
+      Renumber(size_t t_from, size_t t_to) : from(unsigned(t_from)), to(unsigned(t_to)) {}
+      void operator()(std::vector<unsigned> &t_cell) const
+      {
+        std::replace(t_cell.begin(), t_cell.end(), from, to);
+      }
+      unsigned from;
+      unsigned to;
+    };
+
+    /// Objects may hang over the edges of the layer, those parts are kept in
+    /// the border cells
+    int column_of(int t_x) const
+    {
+      return std::min(std::max(t_x, 0) / m_cell_size, m_columns - 1);
+    }
+
+    int row_of(int t_y) const
+    {
+      return std::min(std::max(t_y, 0) / m_cell_size, m_rows - 1);
+    }
+
+    /// The area a placement is listed under: its bounds, or for a zero
+    /// size image the pixel at its corner, so it is still in a cell
+    static Rect footprint(const Rect &t_bounds)
+    {
+      return t_bounds.empty()?Rect(t_bounds.x(), t_bounds.y(), 1, 1):t_bounds;
+    }
+
+    template<typename Func>
+    void forCells(const Rect &t_bounds, const Func &t_func)
+    {
+      const Rect area = footprint(t_bounds);
+
+      for (int row = row_of(area.y()); row <= row_of(area.bottom() - 1); ++row)
+      {
+        for (int column = column_of(area.x()); column <= column_of(area.right() - 1); ++column)
+        {
+          t_func(m_cells[row * m_columns + column]);
+        }
+      }
+    }
+
+    size_t find(const Position &t_position, const boost::shared_ptr<Object> &t_object) const
+    {
+      std::map<const Object *, unsigned>::const_iterator itr = m_sprite_ids.find(t_object.get());
+      return itr == m_sprite_ids.end()?npos:find(t_position, itr->second);
+    }
+
+    size_t find(const Position &t_position, unsigned t_sprite) const
+    {
+      const Rect bounds = footprint(m_sprites[t_sprite]->bounds(t_position));
+      const std::vector<unsigned> &cell = m_cells[row_of(bounds.y()) * m_columns + column_of(bounds.x())];
+
+      for (std::vector<unsigned>::const_iterator itr = cell.begin();
+           itr != cell.end();
+           ++itr)
+      {
+        if (m_placements[*itr].sprite == t_sprite && m_placements[*itr].position == t_position)
+        {
+          return *itr;
+        }
+      }
+
+      return npos;
+    }
+
+    int m_cell_size;
+    int m_columns;
+    int m_rows;
+
+    std::vector<Placement> m_placements;
+    Handle_Table m_handles;
+    std::vector<std::vector<unsigned> > m_cells;
+    mutable unsigned m_query;
+
+    std::vector<boost::shared_ptr<Object> > m_sprites; // by sprite id, NULL for ids on m_free_sprites
+    std::vector<unsigned> m_sprite_uses; // placements of each sprite
+    std::vector<unsigned> m_free_sprites;
+    std::map<const Object *, unsigned> m_sprite_ids;
+};
+
+#endif
@@ -0,0 +1,321 @@
+#ifndef CHAIGAME_PIXEL_KERNELS_HPP_
+#define CHAIGAME_PIXEL_KERNELS_HPP_
+
+#include <SDL/SDL.h>
+#include <algorithm>
+#include <cstring>
+#include <string>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CHAIGAME_KERNELS_X86
+#define CHAIGAME_KERNELS_AVX2
+#include <immintrin.h>
+#define CHAIGAME_TARGET(t) __attribute__((target(t)))
+#elif defined(_MSC_VER) && defined(_M_X64)
+#define CHAIGAME_KERNELS_X86
+#include <emmintrin.h>
+#define CHAIGAME_TARGET(t)
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define CHAIGAME_KERNELS_NEON
+#include <arm_neon.h>
+#endif
+
+/// Row kernels for the hot 32 bit pixel operations, with SIMD versions
+/// picked once at runtime by what the CPU supports.
+///
+/// blend composites pixels with 8 bit alpha in their top byte over the
+/// destination the way SDL does for RGBA to RGB(A) blits: colour channels
+/// are mixed, the destination's own alpha is left alone. Alpha is spread
+/// to 0..256 so fully opaque pixels are copied exactly.
+/// colourKey copies every pixel whose colour bits, t_mask, differ from
+/// t_key.
+struct Pixel_Kernels
+{
+  const char *name;
+  void (*copy)(Uint32 *t_dst, const Uint32 *t_src, int t_count);
+  void (*blend)(Uint32 *t_dst, const Uint32 *t_src, int t_count);
+  void (*colourKey)(Uint32 *t_dst, const Uint32 *t_src, int t_count, Uint32 t_key, Uint32 t_mask);
+  void (*fill)(Uint32 *t_dst, int t_count, Uint32 t_colour);
+
+  static void copyRow(Uint32 *t_dst, const Uint32 *t_src, int t_count)
+  {
+    memcpy(t_dst, t_src, t_count * sizeof(Uint32));
+  }
+
+  static Uint32 blendPixel(Uint32 t_dst, Uint32 t_src)
+  {
+    Uint32 alpha = t_src >> 24;
+    alpha += alpha >> 7;
+    const Uint32 inverse = 256 - alpha;
+
+    const Uint32 rb = (((t_src & 0xff00ff) * alpha + (t_dst & 0xff00ff) * inverse) >> 8) & 0xff00ff;
+    const Uint32 g = (((t_src & 0xff00) * alpha + (t_dst & 0xff00) * inverse) >> 8) & 0xff00;
+    return rb | g | (t_dst & 0xff000000);
+  }
+
+  static void blendRow(Uint32 *t_dst, const Uint32 *t_src, int t_count)
+  {
+    for (int i = 0; i < t_count; ++i)
+    {
+      t_dst[i] = blendPixel(t_dst[i], t_src[i]);
+    }
+  }
+
+  static void colourKeyRow(Uint32 *t_dst, const Uint32 *t_src, int t_count, Uint32 t_key, Uint32 t_mask)
+  {
+    for (int i = 0; i < t_count; ++i)
+    {
+      if ((t_src[i] & t_mask) != t_key)
+      {
+        t_dst[i] = t_src[i];
+      }
+    }
+  }
+
+  static void fillRow(Uint32 *t_dst, int t_count, Uint32 t_colour)
+  {
+    std::fill(t_dst, t_dst + t_count, t_colour);
+  }
+
+#ifdef CHAIGAME_KERNELS_X86
+  /// Blends the 4 pixels of t_src over t_dst
+  CHAIGAME_TARGET("sse2") static __m128i blend4(__m128i t_dst, __m128i t_src)
+  {
+    const __m128i zero = _mm_setzero_si128();
+
+    __m128i alpha = _mm_srli_epi32(t_src, 24);
+    alpha = _mm_add_epi32(alpha, _mm_srli_epi32(alpha, 7));
+    alpha = _mm_or_si128(alpha, _mm_slli_epi32(alpha, 16));
+    const __m128i alpha_lo = _mm_unpacklo_epi32(alpha, alpha);
+    const __m128i alpha_hi = _mm_unpackhi_epi32(alpha, alpha);
+    const __m128i full = _mm_set1_epi16(256);
+
+    const __m128i lo = _mm_srli_epi16(_mm_add_epi16(
+          _mm_mullo_epi16(_mm_unpacklo_epi8(t_src, zero), alpha_lo),
+          _mm_mullo_epi16(_mm_unpacklo_epi8(t_dst, zero), _mm_sub_epi16(full, alpha_lo))), 8);
+    const __m128i hi = _mm_srli_epi16(_mm_add_epi16(
+          _mm_mullo_epi16(_mm_unpackhi_epi8(t_src, zero), alpha_hi),
+          _mm_mullo_epi16(_mm_unpackhi_epi8(t_dst, zero), _mm_sub_epi16(full, alpha_hi))), 8);
+
+    const __m128i alpha_mask = _mm_set1_epi32(int(0xff000000));
+    return _mm_or_si128(_mm_andnot_si128(alpha_mask, _mm_packus_epi16(lo, hi)), _mm_and_si128(alpha_mask, t_dst));
+  }
+
+  CHAIGAME_TARGET("sse2") static void blendRowSSE2(Uint32 *t_dst, const Uint32 *t_src, int t_count)
+  {
+    int i = 0;
+    for (; i + 4 <= t_count; i += 4)
+    {
+      __m128i *dst = reinterpret_cast<__m128i *>(t_dst + i);
+      _mm_storeu_si128(dst, blend4(_mm_loadu_si128(dst), _mm_loadu_si128(reinterpret_cast<const __m128i *>(t_src + i))));
+    }
+    blendRow(t_dst + i, t_src + i, t_count - i);
+  }
+
+  CHAIGAME_TARGET("sse2") static void colourKeyRowSSE2(Uint32 *t_dst, const Uint32 *t_src, int t_count, Uint32 t_key, Uint32 t_mask)
+  {
+    const __m128i key = _mm_set1_epi32(int(t_key));
+    const __m128i mask = _mm_set1_epi32(int(t_mask));
+
+    int i = 0;
+    for (; i + 4 <= t_count; i += 4)
+    {
+      __m128i *dst = reinterpret_cast<__m128i *>(t_dst + i);
+      const __m128i src = _mm_loadu_si128(reinterpret_cast<const __m128i *>(t_src + i));
+      const __m128i keyed = _mm_cmpeq_epi32(_mm_and_si128(src, mask), key);
+      _mm_storeu_si128(dst, _mm_or_si128(_mm_and_si128(keyed, _mm_loadu_si128(dst)), _mm_andnot_si128(keyed, src)));
+    }
+    colourKeyRow(t_dst + i, t_src + i, t_count - i, t_key, t_mask);
+  }
+
+  CHAIGAME_TARGET("sse2") static void fillRowSSE2(Uint32 *t_dst, int t_count, Uint32 t_colour)
+  {
+    const __m128i colour = _mm_set1_epi32(int(t_colour));
+
+    int i = 0;
+    for (; i + 4 <= t_count; i += 4)
+    {
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(t_dst + i), colour);
+    }
+    fillRow(t_dst + i, t_count - i, t_colour);
+  }
+#endif
+
+#ifdef CHAIGAME_KERNELS_AVX2
+  /// Same as blend4, on 8 pixels. The unpacks work within each 128 bit
+  /// half, which the packs undo in the same way.
+  CHAIGAME_TARGET("avx2") static __m256i blend8(__m256i t_dst, __m256i t_src)
+  {
+    const __m256i zero = _mm256_setzero_si256();
+
+    __m256i alpha = _mm256_srli_epi32(t_src, 24);
+    alpha = _mm256_add_epi32(alpha, _mm256_srli_epi32(alpha, 7));
+    alpha = _mm256_or_si256(alpha, _mm256_slli_epi32(alpha, 16));
+    const __m256i alpha_lo = _mm256_unpacklo_epi32(alpha, alpha);
+    const __m256i alpha_hi = _mm256_unpackhi_epi32(alpha, alpha);
+    const __m256i full = _mm256_set1_epi16(256);
+
+    const __m256i lo = _mm256_srli_epi16(_mm256_add_epi16(
+          _mm256_mullo_epi16(_mm256_unpacklo_epi8(t_src, zero), alpha_lo),
+          _mm256_mullo_epi16(_mm256_unpacklo_epi8(t_dst, zero), _mm256_sub_epi16(full, alpha_lo))), 8);
+    const __m256i hi = _mm256_srli_epi16(_mm256_add_epi16(
+          _mm256_mullo_epi16(_mm256_unpackhi_epi8(t_src, zero), alpha_hi),
+          _mm256_mullo_epi16(_mm256_unpackhi_epi8(t_dst, zero), _mm256_sub_epi16(full, alpha_hi))), 8);
+
+    const __m256i alpha_mask = _mm256_set1_epi32(int(0xff000000));
+    return _mm256_or_si256(_mm256_andnot_si256(alpha_mask, _mm256_packus_epi16(lo, hi)),
+        _mm256_and_si256(alpha_mask, t_dst));
+  }
+
+  CHAIGAME_TARGET("avx2") static void blendRowAVX2(Uint32 *t_dst, const Uint32 *t_src, int t_count)
+  {
+    int i = 0;
+    for (; i + 8 <= t_count; i += 8)
+    {
+      __m256i *dst = reinterpret_cast<__m256i *>(t_dst + i);
+      _mm256_storeu_si256(dst, blend8(_mm256_loadu_si256(dst), _mm256_loadu_si256(reinterpret_cast<const __m256i *>(t_src + i))));
+    }
+    blendRowSSE2(t_dst + i, t_src + i, t_count - i);
+  }
+
+  CHAIGAME_TARGET("avx2") static void colourKeyRowAVX2(Uint32 *t_dst, const Uint32 *t_src, int t_count, Uint32 t_key, Uint32 t_mask)
+  {
+    const __m256i key = _mm256_set1_epi32(int(t_key));
+    const __m256i mask = _mm256_set1_epi32(int(t_mask));
+
+    int i = 0;
+    for (; i + 8 <= t_count; i += 8)
+    {
+      __m256i *dst = reinterpret_cast<__m256i *>(t_dst + i);
+      const __m256i src = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(t_src + i));
+      const __m256i keyed = _mm256_cmpeq_epi32(_mm256_and_si256(src, mask), key);
+      _mm256_storeu_si256(dst, _mm256_blendv_epi8(src, _mm256_loadu_si256(dst), keyed));
+    }
+    colourKeyRowSSE2(t_dst + i, t_src + i, t_count - i, t_key, t_mask);
+  }
+
+  CHAIGAME_TARGET("avx2") static void fillRowAVX2(Uint32 *t_dst, int t_count, Uint32 t_colour)
+  {
+    const __m256i colour = _mm256_set1_epi32(int(t_colour));
+
+    int i = 0;
+    for (; i + 8 <= t_count; i += 8)
+    {
+      _mm256_storeu_si256(reinterpret_cast<__m256i *>(t_dst + i), colour);
+    }
+    fillRowSSE2(t_dst + i, t_count - i, t_colour);
+  }
+#endif
+
+#ifdef CHAIGAME_KERNELS_NEON
+  /// Works on 8 pixels at a time, split into one register per channel.
+  /// Assumes little endian, so byte 3 of each pixel is its alpha.
+  static void blendRowNEON(Uint32 *t_dst, const Uint32 *t_src, int t_count)
+  {
+    const uint16x8_t full = vdupq_n_u16(256);
+
+    int i = 0;
+    for (; i + 8 <= t_count; i += 8)
+    {
+      uint8_t *dst = reinterpret_cast<uint8_t *>(t_dst + i);
+      const uint8x8x4_t s = vld4_u8(reinterpret_cast<const uint8_t *>(t_src + i));
+      uint8x8x4_t d = vld4_u8(dst);
+
+      uint16x8_t alpha = vmovl_u8(s.val[3]);
+      alpha = vaddq_u16(alpha, vshrq_n_u16(alpha, 7));
+      const uint16x8_t inverse = vsubq_u16(full, alpha);
+
+      for (int c = 0; c < 3; ++c)
+      {
+        d.val[c] = vshrn_n_u16(vaddq_u16(vmulq_u16(vmovl_u8(s.val[c]), alpha),
+              vmulq_u16(vmovl_u8(d.val[c]), inverse)), 8);
+      }
+
+      vst4_u8(dst, d);
+    }
+    blendRow(t_dst + i, t_src + i, t_count - i);
+  }
+
+  static void colourKeyRowNEON(Uint32 *t_dst, const Uint32 *t_src, int t_count, Uint32 t_key, Uint32 t_mask)
+  {
+    const uint32x4_t key = vdupq_n_u32(t_key);
+    const uint32x4_t mask = vdupq_n_u32(t_mask);
+
+    int i = 0;
+    for (; i + 4 <= t_count; i += 4)
+    {
+      const uint32x4_t src = vld1q_u32(t_src + i);
+      const uint32x4_t keyed = vceqq_u32(vandq_u32(src, mask), key);
+      vst1q_u32(t_dst + i, vbslq_u32(keyed, vld1q_u32(t_dst + i), src));
+    }
+    colourKeyRow(t_dst + i, t_src + i, t_count - i, t_key, t_mask);
+  }
+
+  static void fillRowNEON(Uint32 *t_dst, int t_count, Uint32 t_colour)
+  {
+    const uint32x4_t colour = vdupq_n_u32(t_colour);
+
+    int i = 0;
+    for (; i + 4 <= t_count; i += 4)
+    {
+      vst1q_u32(t_dst + i, colour);
+    }
+    fillRow(t_dst + i, t_count - i, t_colour);
+  }
+#endif
+
+  static Pixel_Kernels select()
+  {
+    const Pixel_Kernels scalar = { "scalar", &copyRow, &blendRow, &colourKeyRow, &fillRow };
+    Pixel_Kernels best = scalar;
+
+#ifdef CHAIGAME_KERNELS_X86
+    const Pixel_Kernels sse2 = { "sse2", &copyRow, &blendRowSSE2, &colourKeyRowSSE2, &fillRowSSE2 };
+#if defined(__GNUC__) && defined(__i386__)
+    if (__builtin_cpu_supports("sse2"))
+#endif
+    {
+      best = sse2;
+    }
+#endif
+
+#ifdef CHAIGAME_KERNELS_AVX2
+    const Pixel_Kernels avx2 = { "avx2", &copyRow, &blendRowAVX2, &colourKeyRowAVX2, &fillRowAVX2 };
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("sse2"))
+    {
+      best = avx2;
+    }
+#endif
+
+#ifdef CHAIGAME_KERNELS_NEON
+    const Pixel_Kernels neon = { "neon", &copyRow, &blendRowNEON, &colourKeyRowNEON, &fillRowNEON };
+    best = neon;
+#endif
+
+    // CHAIGAME_KERNELS=scalar or =sse2 forces a weaker set, for comparing
+    // them
+    const char *forced = SDL_getenv("CHAIGAME_KERNELS");
+    if (forced && std::string(forced) == scalar.name)
+    {
+      best = scalar;
+    }
+#ifdef CHAIGAME_KERNELS_X86
+    if (forced && std::string(forced) == sse2.name)
+    {
+      best = sse2;
+    }
+#endif
+
+    return best;
+  }
+};
+
+/// The best kernels for this CPU. The first call picks them, so make it
+/// before starting threads that use them.
+inline const Pixel_Kernels &pixelKernels()
+{
+  static const Pixel_Kernels kernels = Pixel_Kernels::select();
+  return kernels;
+}
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef CHAIGAME_PROFILE_OVERLAY_HPP_
+#define CHAIGAME_PROFILE_OVERLAY_HPP_
+
+#include <algorithm>
+
+#include "geometry.hpp"
+#include "profiler.hpp"
+#include "renderer.hpp"
+
+/// Draws the recent frame times as a bar graph in the screen's bottom left
+/// corner, one bar per frame stacked by profiler section, with a line at
+/// the 60 Hz frame budget. Bars of frames too slow to fit are cut off at the
+/// top of the box.
+class Profile_Overlay : public Overlay
+{
+  public:
+    Profile_Overlay()
+      : m_width(2 * 150), m_height(100), m_pixels_per_ms(4)
+    {
+    }
+
+    virtual Rect area(const Rect &t_screen) const
+    {
+      return Rect(t_screen.x(), t_screen.bottom() - m_height, m_width, m_height);
+    }
+
+    virtual void draw(Renderer &t_renderer)
+    {
+      static const Uint8 colours[Profiler::Section_Count][3] = {
+        { 255, 255, 0 }, { 0, 255, 255 }, { 128, 128, 128 }, { 0, 192, 0 }, { 255, 0, 255 }, { 0, 0, 255 } };
+
+      const Rect box = area(t_renderer.bounds());
+      t_renderer.fill(box, 0, 0, 0);
+
+      const size_t bars = std::min(profiler().frames(), size_t(m_width / 2));
+      for (size_t age = 0; age < bars; ++age)
+      {
+        const Profiler::Frame &frame = profiler().frame(age);
+        const int x = box.right() - 2 * int(age + 1);
+        int y = box.bottom();
+
+        // sections exclude those nested in them, so they stack up to at
+        // most the frame
+        for (int i = Profiler::Section_Count - 1; i >= 0 && y > box.y(); --i)
+        {
+          const int h = std::min(int(frame.sections[i] * 1000 * m_pixels_per_ms), y - box.y());
+          if (h > 0)
+          {
+            t_renderer.fill(Rect(x, y - h, 2, h), colours[i][0], colours[i][1], colours[i][2]);
+            y -= h;
+          }
+        }
+
+        // the remainder of the frame outside any section
+        const int top = std::max(box.bottom() - int(frame.duration * 1000 * m_pixels_per_ms), box.y());
+        if (top < y)
+        {
+          t_renderer.fill(Rect(x, top, 2, y - top), 255, 255, 255);
+        }
+      }
+
+      t_renderer.fill(Rect(box.x(), box.bottom() - int(1000.0 / 60 * m_pixels_per_ms), box.w(), 1), 255, 0, 0);
+    }
+
+  private:
+    int m_width;
+    int m_height;
+    int m_pixels_per_ms;
+};
+
+#endif
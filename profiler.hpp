@@ -0,0 +1,310 @@
+#ifndef CHAIGAME_PROFILER_HPP_
+#define CHAIGAME_PROFILER_HPP_
+
+#include <ostream>
+#include <vector>
+#include <algorithm>
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+/// Monotonic time in seconds, at the best resolution the platform offers
+inline double currentTime()
+{
+#ifdef _WIN32
+  LARGE_INTEGER frequency;
+  LARGE_INTEGER counter;
+  QueryPerformanceFrequency(&frequency);
+  QueryPerformanceCounter(&counter);
+  return double(counter.QuadPart) / double(frequency.QuadPart);
+#else
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+#endif
+}
+
+/// Low overhead frame profiler. Timed sections and blit counts accumulate
+/// into a fixed ring of per frame records, and each timed section is also
+/// kept in a ring of events for trace dumps. Everything it measures runs
+/// on the main thread, so neither ring needs any locking.
+/// Profile_Scopes nest: Bake runs inside Layer_Render when a layer bakes
+/// what it is about to show, and inside other Bake scopes when rebaking
+/// updates the pre-shifted copies. A frame's sections hold each section's
+/// own time, without the sections nested in it, so they add up to no more
+/// than the frame; trace events keep the full duration of each scope.
+class Profiler
+{
+  public:
+    enum Section
+    {
+      Events,
+      Update,
+      Clear,
+      Layer_Render,
+      Bake,
+      Present,
+      Section_Count
+    };
+
+    struct Frame
+    {
+      double start;
+      double duration;
+      double sections[Section_Count]; // total seconds spent in each section, excluding those nested in it
+      unsigned long blits;
+      unsigned long pixels;
+    };
+
+    struct Event
+    {
+      Section section;
+      int index; // e.g. the layer rendered, -1 if not applicable
+      double start;
+      double duration;
+    };
+
+    struct Summary
+    {
+      size_t frames;
+      double p50; // frame times in seconds
+      double p99;
+      double max;
+      double blits; // per frame averages
+      double pixels;
+    };
+
+    static const char *name(Section t_section)
+    {
+      static const char *names[Section_Count] = { "handleSDLEvents", "updateState", "clear",
+        "Layer::render", "bake", "present" };
+      return names[t_section];
+    }
+
+    Profiler(size_t t_frames = 600, size_t t_events = 16384)
+      : m_enabled(true), m_frames(t_frames), m_frame_count(0), m_events(t_events), m_event_count(0)
+    {
+      resetCurrent(currentTime());
+    }
+
+    void setEnabled(bool t_enabled)
+    {
+      m_enabled = t_enabled;
+    }
+
+    bool enabled() const
+    {
+      return m_enabled;
+    }
+
+    /// Holds the last t_frames frames from now on, dropping the ones held
+    void setHistory(size_t t_frames)
+    {
+      m_frames.assign(std::max<size_t>(t_frames, 1), Frame());
+      m_frame_count = 0;
+    }
+
+    /// Closes the current frame record and starts the next one
+    void endFrame()
+    {
+      if (!m_enabled)
+      {
+        return;
+      }
+
+      const double now = currentTime();
+      m_current.duration = now - m_current.start;
+      m_frames[m_frame_count % m_frames.size()] = m_current;
+      ++m_frame_count;
+      resetCurrent(now);
+    }
+
+    void record(Section t_section, int t_index, double t_start, double t_duration)
+    {
+      m_current.sections[t_section] += t_duration;
+      addEvent(t_section, t_index, t_start, t_duration);
+    }
+
+    /// For Profile_Scope: opens a section, which endScope() closes
+    void beginScope()
+    {
+      m_nested.push_back(0);
+    }
+
+    /// Records a section opened by beginScope(), counting the time of the
+    /// sections nested in it only towards those
+    void endScope(Section t_section, int t_index, double t_start, double t_duration)
+    {
+      const double nested = m_nested.back();
+      m_nested.pop_back();
+
+      if (!m_nested.empty())
+      {
+        m_nested.back() += t_duration;
+      }
+
+      m_current.sections[t_section] += std::max(t_duration - nested, 0.0);
+      addEvent(t_section, t_index, t_start, t_duration);
+    }
+
+    void countBlit(unsigned long t_pixels)
+    {
+      ++m_current.blits;
+      m_current.pixels += t_pixels;
+    }
+
+    /// Number of completed frames currently held
+    size_t frames() const
+    {
+      return std::min(m_frame_count, m_frames.size());
+    }
+
+    /// t_age 0 is the most recently completed frame
+    const Frame &frame(size_t t_age) const
+    {
+      return m_frames[(m_frame_count - 1 - t_age) % m_frames.size()];
+    }
+
+    /// Statistics over the last t_frames completed frames
+    Summary summarize(size_t t_frames) const
+    {
+      Summary summary = Summary();
+      summary.frames = std::min(t_frames, frames());
+
+      if (summary.frames == 0)
+      {
+        return summary;
+      }
+
+      std::vector<double> times;
+      for (size_t i = 0; i < summary.frames; ++i)
+      {
+        const Frame &f = frame(i);
+        times.push_back(f.duration);
+        summary.blits += f.blits;
+        summary.pixels += f.pixels;
+      }
+
+      summary.blits /= summary.frames;
+      summary.pixels /= summary.frames;
+
+      std::sort(times.begin(), times.end());
+      summary.p50 = times[(times.size() - 1) / 2];
+      summary.p99 = times[(times.size() - 1) * 99 / 100];
+      summary.max = times.back();
+
+      return summary;
+    }
+
+    /// One row per held frame, times in milliseconds
+    void writeCSV(std::ostream &t_os) const
+    {
+      t_os << "frame,start,total";
+      for (int i = 0; i < Section_Count; ++i)
+      {
+        t_os << "," << name(Section(i));
+      }
+      t_os << ",blits,pixels\n";
+
+      for (size_t age = frames(); age > 0; --age)
+      {
+        const Frame &f = frame(age - 1);
+        t_os << m_frame_count - age << "," << f.start * 1000 << "," << f.duration * 1000;
+        for (int i = 0; i < Section_Count; ++i)
+        {
+          t_os << "," << f.sections[i] * 1000;
+        }
+        t_os << "," << f.blits << "," << f.pixels << "\n";
+      }
+    }
+
+    /// Held section events in the Trace Event Format, viewable in
+    /// chrome://tracing and similar tools
+    void writeTrace(std::ostream &t_os) const
+    {
+      t_os << "{\"traceEvents\":[\n";
+
+      const size_t held = std::min(m_event_count, m_events.size());
+      for (size_t i = m_event_count - held; i < m_event_count; ++i)
+      {
+        const Event &e = m_events[i % m_events.size()];
+        t_os << (i == m_event_count - held ? "" : ",\n")
+          << "{\"name\":\"" << name(e.section);
+        if (e.index >= 0)
+        {
+          t_os << " " << e.index;
+        }
+        t_os << "\",\"ph\":\"X\",\"pid\":0,\"tid\":0,\"ts\":" << long(e.start * 1e6)
+          << ",\"dur\":" << long(e.duration * 1e6) << "}";
+      }
+
+      t_os << "\n]}\n";
+    }
+
+  private:
+    void addEvent(Section t_section, int t_index, double t_start, double t_duration)
+    {
+      Event &event = m_events[m_event_count % m_events.size()];
+      event.section = t_section;
+      event.index = t_index;
+      event.start = t_start;
+      event.duration = t_duration;
+      ++m_event_count;
+    }
+
+    void resetCurrent(double t_now)
+    {
+      m_current = Frame();
+      m_current.start = t_now;
+    }
+
+    bool m_enabled;
+    Frame m_current;
+    std::vector<Frame> m_frames;
+    size_t m_frame_count;
+    std::vector<Event> m_events;
+    size_t m_event_count;
+    std::vector<double> m_nested; // seconds spent in sections nested in each open scope, innermost last
+};
+
+inline Profiler &profiler()
+{
+  static Profiler instance;
+  return instance;
+}
+
+/// Times its own lifetime as a profiler section
+class Profile_Scope
+{
+  public:
+    Profile_Scope(Profiler::Section t_section, int t_index = -1)
+      : m_section(t_section), m_index(t_index), m_open(profiler().enabled()), m_start(m_open ? currentTime() : 0)
+    {
+      if (m_open)
+      {
+        profiler().beginScope();
+      }
+    }
+
+    ~Profile_Scope()
+    {
+      if (m_open)
+      {
+        profiler().endScope(m_section, m_index, m_start, currentTime() - m_start);
+      }
+    }
+
+  private:
+    Profile_Scope(const Profile_Scope &);
+    Profile_Scope &operator=(const Profile_Scope &);
+
+    Profiler::Section m_section;
+    int m_index;
+    bool m_open; // profiling was enabled when the scope began
+    double m_start;
+};
+
+#endif
@@ -0,0 +1,560 @@
+#ifndef CHAIGAME_RENDERER_HPP_
+#define CHAIGAME_RENDERER_HPP_
+
+#include <boost/shared_ptr.hpp>
+#include <map>
+#include <stdexcept>
+#include <vector>
+#include <SDL/SDL.h>
+#ifdef CHAIGAME_HAS_OPENGL
+#include <SDL/SDL_opengl.h>
+#endif
+
+#include "geometry.hpp"
+#include "profiler.hpp"
+#include "surface.hpp"
+
+class Renderer;
+
+/// Something drawn over every frame, e.g. diagnostics
+class Overlay
+{
+  public:
+    virtual ~Overlay()
+    {
+    }
+
+    /// Area of the screen the overlay draws on
+    virtual Rect area(const Rect &t_screen) const = 0;
+
+    virtual void draw(Renderer &t_renderer) = 0;
+};
+
+/// Where frames get drawn. Layers and sprites render through this, so the
+/// same scene can be drawn by software blits or by the GPU.
+class Renderer
+{
+  public:
+    virtual ~Renderer()
+    {
+    }
+
+    void setOverlay(const boost::shared_ptr<Overlay> &t_overlay)
+    {
+      m_overlay = t_overlay;
+    }
+
+    /// NULL if there is none
+    const boost::shared_ptr<Overlay> &overlay() const
+    {
+      return m_overlay;
+    }
+
+    /// Draws the overlay, if any, on top of the frame
+    void drawOverlay()
+    {
+      if (m_overlay)
+      {
+        m_overlay->draw(*this);
+      }
+    }
+
+    /// Fills t_area with an opaque colour
+    virtual void fill(const Rect &t_area, Uint8 t_r, Uint8 t_g, Uint8 t_b) = 0;
+
+    /// Size of the render target
+    virtual Rect bounds() const = 0;
+
+    /// Restricts all drawing to t_area
+    virtual void setClip(const Rect &t_area) = 0;
+    virtual Rect clip() const = 0;
+
+    virtual void clear(const Rect &t_area) = 0;
+
+    /// Draws the t_source_area part of t_source with its top left corner at
+    /// t_position
+    virtual void draw(const Surface &t_source, const Rect &t_source_area, const Position &t_position) = 0;
+
+    void draw(const Surface &t_source, const Position &t_position)
+    {
+      draw(t_source, t_source.bounds(), t_position);
+    }
+
+    /// Shows the whole frame
+    virtual void present() = 0;
+
+    /// True if present(t_areas) can show just the given areas, relying on
+    /// the rest of the previous frame still being on the target
+    virtual bool partialUpdates() const = 0;
+    virtual void present(const std::vector<Rect> &t_areas) = 0;
+
+    /// True if present() waits for the display's vertical sync
+    virtual bool synced() const = 0;
+
+  private:
+    boost::shared_ptr<Overlay> m_overlay;
+};
+
+/// Draws with SDL blits onto a Surface, usually the display surface
+class Software_Renderer : public Renderer
+{
+  public:
+    Software_Renderer(Surface &t_target)
+      : m_target(t_target)
+    {
+    }
+
+    virtual Rect bounds() const
+    {
+      return m_target.bounds();
+    }
+
+    virtual void setClip(const Rect &t_area)
+    {
+      m_target.setClip(t_area);
+    }
+
+    virtual Rect clip() const
+    {
+      return m_target.clip();
+    }
+
+    virtual void clear(const Rect &t_area)
+    {
+      m_target.clear(t_area);
+    }
+
+    virtual void fill(const Rect &t_area, Uint8 t_r, Uint8 t_g, Uint8 t_b)
+    {
+      m_target.fill(t_area, t_r, t_g, t_b);
+    }
+
+    virtual void draw(const Surface &t_source, const Rect &t_source_area, const Position &t_position)
+    {
+      t_source.render(m_target, t_position, t_source_area);
+    }
+
+    virtual void present()
+    {
+      m_target.flip();
+    }
+
+    /// Not once the display is double buffered
+    virtual bool partialUpdates() const
+    {
+      return !m_target.doubleBuffered();
+    }
+
+    virtual void present(const std::vector<Rect> &t_areas)
+    {
+      m_target.update(t_areas);
+    }
+
+    virtual bool synced() const
+    {
+      return false;
+    }
+
+  private:
+    Surface &m_target;
+};
+
+/// Renders at a low internal resolution and shows each frame enlarged by a
+/// whole factor onto the display, in one pass over the changed areas.
+/// Drawing goes to t_renderer, which must draw onto t_internal.
+class Scaled_Renderer : public Renderer
+{
+  public:
+    /// The internal surface's top left corner is shown at t_x, t_y
+    Scaled_Renderer(const boost::shared_ptr<Renderer> &t_renderer, Surface &t_internal, Surface &t_display,
+        int t_factor, int t_x, int t_y)
+      : m_renderer(t_renderer), m_internal(t_internal), m_display(t_display),
+        m_factor(t_factor), m_x(t_x), m_y(t_y)
+    {
+    }
+
+    virtual Rect bounds() const
+    {
+      return m_renderer->bounds();
+    }
+
+    virtual void setClip(const Rect &t_area)
+    {
+      m_renderer->setClip(t_area);
+    }
+
+    virtual Rect clip() const
+    {
+      return m_renderer->clip();
+    }
+
+    virtual void clear(const Rect &t_area)
+    {
+      m_renderer->clear(t_area);
+    }
+
+    virtual void fill(const Rect &t_area, Uint8 t_r, Uint8 t_g, Uint8 t_b)
+    {
+      m_renderer->fill(t_area, t_r, t_g, t_b);
+    }
+
+    virtual void draw(const Surface &t_source, const Rect &t_source_area, const Position &t_position)
+    {
+      m_renderer->draw(t_source, t_source_area, t_position);
+    }
+
+    virtual void present()
+    {
+      // finishes off the frame, the internal surface is never displayed
+      m_renderer->present();
+      m_display.enlarge(m_internal, m_internal.bounds(), m_factor, m_x, m_y);
+      m_display.flip();
+    }
+
+    virtual bool partialUpdates() const
+    {
+      return !m_display.doubleBuffered();
+    }
+
+    virtual void present(const std::vector<Rect> &t_areas)
+    {
+      m_renderer->present(t_areas);
+
+      m_scaled.clear();
+      for (std::vector<Rect>::const_iterator itr = t_areas.begin();
+           itr != t_areas.end();
+           ++itr)
+      {
+        m_display.enlarge(m_internal, *itr, m_factor, m_x + itr->x() * m_factor, m_y + itr->y() * m_factor);
+        m_scaled.push_back(Rect(m_x + itr->x() * m_factor, m_y + itr->y() * m_factor,
+              itr->w() * m_factor, itr->h() * m_factor).intersect(m_display.bounds()));
+      }
+
+      m_display.update(m_scaled);
+    }
+
+    virtual bool synced() const
+    {
+      return m_renderer->synced();
+    }
+
+  private:
+    boost::shared_ptr<Renderer> m_renderer;
+    Surface &m_internal;
+    Surface &m_display;
+    int m_factor;
+    int m_x;
+    int m_y;
+    std::vector<Rect> m_scaled;
+};
+
+#ifdef CHAIGAME_HAS_OPENGL
+/// Draws through OpenGL, uploading each Surface it is given as a texture
+/// and drawing it as a textured quad. Textures are refreshed when their
+/// surface's revision changes and dropped once unused for a while.
+/// Surfaces must fit within GL_MAX_TEXTURE_SIZE, chunked layers can be
+/// used for anything bigger.
+/// Frames of t_width by t_height can be shown enlarged in a t_viewport of
+/// a t_window sized window, borders around the viewport are kept black.
+class OpenGL_Renderer : public Renderer
+{
+  public:
+    OpenGL_Renderer(int t_width, int t_height)
+      : m_bounds(0, 0, t_width, t_height), m_viewport(m_bounds), m_window(m_bounds),
+        m_clip(m_bounds), m_frame(0), m_bound(0)
+    {
+      init();
+    }
+
+    OpenGL_Renderer(int t_width, int t_height, const Rect &t_viewport, const Rect &t_window)
+      : m_bounds(0, 0, t_width, t_height), m_viewport(t_viewport), m_window(t_window),
+        m_clip(m_bounds), m_frame(0), m_bound(0)
+    {
+      init();
+    }
+
+    virtual ~OpenGL_Renderer()
+    {
+      for (std::map<unsigned, Texture>::iterator itr = m_textures.begin();
+           itr != m_textures.end();
+           ++itr)
+      {
+        glDeleteTextures(1, &itr->second.id);
+      }
+    }
+
+    virtual Rect bounds() const
+    {
+      return m_bounds;
+    }
+
+    virtual void setClip(const Rect &t_area)
+    {
+      m_clip = t_area.intersect(m_bounds);
+
+      // in window pixels, which are a whole number of frame pixels
+      const int xscale = m_viewport.w() / m_bounds.w();
+      const int yscale = m_viewport.h() / m_bounds.h();
+      glScissor(m_viewport.x() + m_clip.x() * xscale,
+          m_window.h() - m_viewport.y() - m_clip.bottom() * yscale,
+          m_clip.w() * xscale, m_clip.h() * yscale);
+    }
+
+    virtual Rect clip() const
+    {
+      return m_clip;
+    }
+
+    virtual void clear(const Rect &t_area)
+    {
+      const Rect clip = m_clip;
+      setClip(t_area.intersect(clip));
+      glClear(GL_COLOR_BUFFER_BIT);
+      setClip(clip);
+    }
+
+    virtual void fill(const Rect &t_area, Uint8 t_r, Uint8 t_g, Uint8 t_b)
+    {
+      glDisable(GL_TEXTURE_2D);
+      glDisable(GL_BLEND);
+      glColor3ub(t_r, t_g, t_b);
+      glRecti(t_area.x(), t_area.y(), t_area.right(), t_area.bottom());
+      glColor4f(1, 1, 1, 1);
+      glEnable(GL_TEXTURE_2D);
+    }
+
+    virtual void draw(const Surface &t_source, const Rect &t_source_area, const Position &t_position)
+    {
+      const Texture &texture = getTexture(t_source);
+
+      if (texture.id != m_bound)
+      {
+        glBindTexture(GL_TEXTURE_2D, texture.id);
+        m_bound = texture.id;
+      }
+
+      if (texture.blend)
+      {
+        glEnable(GL_BLEND);
+      } else {
+        glDisable(GL_BLEND);
+      }
+
+      const GLfloat u0 = GLfloat(t_source_area.x()) / texture.width;
+      const GLfloat v0 = GLfloat(t_source_area.y()) / texture.height;
+      const GLfloat u1 = GLfloat(t_source_area.right()) / texture.width;
+      const GLfloat v1 = GLfloat(t_source_area.bottom()) / texture.height;
+
+      const GLfloat x0 = GLfloat(int(t_position.x()));
+      const GLfloat y0 = GLfloat(int(t_position.y()));
+      const GLfloat x1 = x0 + t_source_area.w();
+      const GLfloat y1 = y0 + t_source_area.h();
+
+      const Rect drawn = Rect(int(x0), int(y0), t_source_area.w(), t_source_area.h()).intersect(m_clip);
+      profiler().countBlit(drawn.w() * drawn.h());
+
+      glBegin(GL_QUADS);
+      glTexCoord2f(u0, v0); glVertex2f(x0, y0);
+      glTexCoord2f(u1, v0); glVertex2f(x1, y0);
+      glTexCoord2f(u1, v1); glVertex2f(x1, y1);
+      glTexCoord2f(u0, v1); glVertex2f(x0, y1);
+      glEnd();
+    }
+
+    virtual void present()
+    {
+      SDL_GL_SwapBuffers();
+      clearBorders();
+      collectGarbage();
+    }
+
+    /// The back buffer's contents are undefined after a swap
+    virtual bool partialUpdates() const
+    {
+      return false;
+    }
+
+    virtual void present(const std::vector<Rect> &)
+    {
+      present();
+    }
+
+    virtual bool synced() const
+    {
+      int swap_control = 0;
+      return SDL_GL_GetAttribute(SDL_GL_SWAP_CONTROL, &swap_control) == 0 && swap_control > 0;
+    }
+
+  private:
+    void init()
+    {
+      glViewport(m_viewport.x(), m_window.h() - m_viewport.bottom(), m_viewport.w(), m_viewport.h());
+      glMatrixMode(GL_PROJECTION);
+      glLoadIdentity();
+      glOrtho(0, m_bounds.w(), m_bounds.h(), 0, -1, 1);
+      glMatrixMode(GL_MODELVIEW);
+      glLoadIdentity();
+
+      glDisable(GL_DEPTH_TEST);
+      glEnable(GL_TEXTURE_2D);
+      glEnable(GL_SCISSOR_TEST);
+      glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+      glClearColor(0, 0, 0, 0);
+      glColor4f(1, 1, 1, 1);
+
+      clearBorders();
+      setClip(m_bounds);
+    }
+
+    /// Blacks out the window around the viewport, on the back buffer
+    void clearBorders()
+    {
+      if (m_viewport.w() != m_window.w() || m_viewport.h() != m_window.h())
+      {
+        glDisable(GL_SCISSOR_TEST);
+        glClear(GL_COLOR_BUFFER_BIT);
+        glEnable(GL_SCISSOR_TEST);
+      }
+    }
+
+    struct Texture
+    {
+      GLuint id;
+      unsigned revision;
+      unsigned last_used;
+      int width;
+      int height;
+      bool blend;
+    };
+
+    const Texture &getTexture(const Surface &t_surface)
+    {
+      std::map<unsigned, Texture>::iterator itr = m_textures.find(t_surface.serial());
+
+      if (itr == m_textures.end())
+      {
+        Texture texture;
+        glGenTextures(1, &texture.id);
+        glBindTexture(GL_TEXTURE_2D, texture.id);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        m_bound = texture.id;
+
+        texture.width = t_surface.m_surface->w;
+        texture.height = t_surface.m_surface->h;
+        texture.blend = !t_surface.opaque();
+        upload(t_surface, texture, true);
+
+        itr = m_textures.insert(std::make_pair(t_surface.serial(), texture)).first;
+      } else if (itr->second.revision != t_surface.revision()) {
+        Texture &texture = itr->second;
+        glBindTexture(GL_TEXTURE_2D, texture.id);
+        m_bound = texture.id;
+
+        // a reloaded image may have changed size or gained translucency,
+        // which takes specifying the texture over again
+        const bool resized = texture.width != t_surface.m_surface->w || texture.height != t_surface.m_surface->h
+          || texture.blend != !t_surface.opaque();
+        texture.width = t_surface.m_surface->w;
+        texture.height = t_surface.m_surface->h;
+        texture.blend = !t_surface.opaque();
+        upload(t_surface, texture, resized);
+      }
+
+      itr->second.last_used = m_frame;
+      return itr->second;
+    }
+
+    /// Uploads the surface's pixels as 32 bit BGRA, converting them first
+    /// unless they are already laid out that way
+    void upload(const Surface &t_surface, Texture &t_texture, bool t_create)
+    {
+      SDL_Surface *src = t_surface.m_surface;
+      SDL_Surface *converted = 0;
+
+      if (src->flags & SDL_SRCCOLORKEY)
+      {
+        // turns the colour key into alpha
+        converted = SDL_DisplayFormatAlpha(src);
+      } else if (src->format->BytesPerPixel != 4 || src->format->Rmask != 0x00ff0000
+          || src->format->Gmask != 0x0000ff00 || src->format->Bmask != 0x000000ff) {
+        SDL_PixelFormat format = *src->format;
+        format.palette = 0;
+        format.BitsPerPixel = 32;
+        format.BytesPerPixel = 4;
+        format.Rmask = 0x00ff0000; format.Rshift = 16; format.Rloss = 0;
+        format.Gmask = 0x0000ff00; format.Gshift = 8; format.Gloss = 0;
+        format.Bmask = 0x000000ff; format.Bshift = 0; format.Bloss = 0;
+        format.Amask = 0xff000000; format.Ashift = 24; format.Aloss = 0;
+        converted = SDL_ConvertSurface(src, &format, SDL_SWSURFACE);
+      }
+
+      SDL_Surface *pixels = converted?converted:src;
+
+      if (!pixels)
+      {
+        throw std::runtime_error(std::string("Unable to convert surface for upload: ") + SDL_GetError());
+      }
+
+      SDL_LockSurface(pixels);
+      glPixelStorei(GL_UNPACK_ROW_LENGTH, pixels->pitch / 4);
+      if (t_create)
+      {
+        glTexImage2D(GL_TEXTURE_2D, 0, t_texture.blend?GL_RGBA:GL_RGB, t_texture.width, t_texture.height, 0,
+            GL_BGRA, GL_UNSIGNED_BYTE, pixels->pixels);
+      } else {
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, t_texture.width, t_texture.height,
+            GL_BGRA, GL_UNSIGNED_BYTE, pixels->pixels);
+      }
+      glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+      SDL_UnlockSurface(pixels);
+
+      if (converted)
+      {
+        SDL_FreeSurface(converted);
+      }
+
+      if (glGetError() != GL_NO_ERROR)
+      {
+        throw std::runtime_error("Unable to upload texture");
+      }
+
+      t_texture.revision = t_surface.revision();
+    }
+
+    /// Surfaces don't tell us when they go away, so textures nobody drew
+    /// for a couple of seconds are released
+    void collectGarbage()
+    {
+      ++m_frame;
+
+      std::map<unsigned, Texture>::iterator itr = m_textures.begin();
+      while (itr != m_textures.end())
+      {
+        if (m_frame - itr->second.last_used > 120)
+        {
+          if (m_bound == itr->second.id)
+          {
+            m_bound = 0;
+          }
+          glDeleteTextures(1, &itr->second.id);
+          m_textures.erase(itr++);
+        } else {
+          ++itr;
+        }
+      }
+    }
+
+    Rect m_bounds;
+    Rect m_viewport; // in window pixels
+    Rect m_window;
+    Rect m_clip;
+    std::map<unsigned, Texture> m_textures; // by surface serial
+    unsigned m_frame;
+    GLuint m_bound;
+};
+#endif
+
+#endif
@@ -0,0 +1,247 @@
+#ifndef CHAIGAME_REPLAY_HPP_
+#define CHAIGAME_REPLAY_HPP_
+
+#include <SDL/SDL.h>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/// A recorded session: the simulation steps each frame ran, how far
+/// between steps each frame was drawn, and the input every step applied.
+/// Playing it back steps the simulation exactly as it was stepped live and
+/// renders the same positions, independent of the clock, so a session can
+/// be rerun as a benchmark.
+/// Every record is four bytes: a frame costs one, plus one per key press
+/// or release. Like room packs, replays are meant to be played back on the
+/// same kind of machine, the byte order and layout are native.
+class Replay
+{
+  public:
+    enum Kind
+    {
+      Frame, // step: steps run, value: alpha in 1/65535ths
+      Key_Down, // step: index within the frame, value: SDLKey
+      Key_Up,
+      Quit
+    };
+
+    struct Record
+    {
+      Uint8 kind; // Kind
+      Uint8 step;
+      Uint16 value;
+    };
+
+    struct Header
+    {
+      char magic[4];
+      Uint32 byte_order;
+      Uint32 version;
+      Uint32 reserved;
+      double step; // seconds per simulation step
+    };
+
+    static const Uint32 Version = 1;
+    static const Uint32 Byte_Order = 0x01020304;
+
+    static Uint16 quantize(double t_alpha)
+    {
+      return Uint16(std::min(std::max(t_alpha, 0.0), 1.0) * 65535 + 0.5);
+    }
+};
+
+/// Writes a Replay as the session runs. Events are held back until their
+/// frame ends, since playback needs to know a frame's steps first.
+class Replay_Recorder
+{
+  public:
+    Replay_Recorder(const std::string &t_filename, double t_step)
+      : m_filename(t_filename), m_file(t_filename.c_str(), std::ios::binary | std::ios::trunc)
+    {
+      Replay::Header header = Replay::Header();
+      memcpy(header.magic, "CGRL", 4);
+      header.byte_order = Replay::Byte_Order;
+      header.version = Replay::Version;
+      header.step = t_step;
+
+      if (!m_file.write(reinterpret_cast<const char *>(&header), sizeof(header)))
+      {
+        throw std::runtime_error("Unable to write replay: " + t_filename);
+      }
+    }
+
+    /// Records t_event if it steers the simulation, as applied by step
+    /// t_step of the current frame
+    void event(int t_step, const SDL_Event &t_event)
+    {
+      Replay::Record record = Replay::Record();
+      record.step = Uint8(t_step);
+
+      switch (t_event.type)
+      {
+        case SDL_KEYDOWN:
+        case SDL_KEYUP:
+          record.kind = t_event.key.state == SDL_PRESSED?Replay::Key_Down:Replay::Key_Up;
+          record.value = Uint16(t_event.key.keysym.sym);
+          break;
+        case SDL_QUIT:
+          record.kind = Replay::Quit;
+          break;
+
+        default:
+          return;
+      }
+
+      m_events.push_back(record);
+    }
+
+    /// Writes the frame that ran t_steps steps and is drawn t_alpha of the
+    /// way past the last of them, with its events
+    void endFrame(int t_steps, double t_alpha)
+    {
+      Replay::Record frame = Replay::Record();
+      frame.kind = Replay::Frame;
+      frame.step = Uint8(t_steps);
+      frame.value = Replay::quantize(t_alpha);
+
+      m_file.write(reinterpret_cast<const char *>(&frame), sizeof(frame));
+      if (!m_events.empty())
+      {
+        m_file.write(reinterpret_cast<const char *>(&m_events.front()), m_events.size() * sizeof(Replay::Record));
+        m_events.clear();
+      }
+
+      if (!m_file)
+      {
+        throw std::runtime_error("Unable to write replay: " + m_filename);
+      }
+    }
+
+  private:
+    std::string m_filename;
+    std::ofstream m_file;
+    std::vector<Replay::Record> m_events; // of the current frame
+};
+
+/// Plays a Replay back. The whole file is read up front, so playback does
+/// no I/O that would show up in the frame times.
+/// beginFrame() and alpha() stand in for the Loop_Scheduler's, events()
+/// hands out the input of each step.
+class Replay_Player
+{
+  public:
+    explicit Replay_Player(const std::string &t_filename)
+      : m_next(0), m_frames(0), m_length(0), m_alpha(0), m_finished(false)
+    {
+      std::ifstream file(t_filename.c_str(), std::ios::binary);
+      Replay::Header header;
+
+      if (!file.read(reinterpret_cast<char *>(&header), sizeof(header))
+          || memcmp(header.magic, "CGRL", 4) != 0
+          || header.byte_order != Replay::Byte_Order
+          || header.version != Replay::Version)
+      {
+        throw std::runtime_error("Not a replay, or from another version: " + t_filename);
+      }
+
+      m_step = header.step;
+
+      Replay::Record record;
+      while (file.read(reinterpret_cast<char *>(&record), sizeof(record)))
+      {
+        m_records.push_back(record);
+        m_length += record.kind == Replay::Frame?1:0;
+      }
+    }
+
+    /// Seconds per simulation step the replay was recorded with
+    double step() const
+    {
+      return m_step;
+    }
+
+    /// Starts the next recorded frame, returns how many steps it ran. Once
+    /// every frame has been played back, returns 0 and finished() is true.
+    int beginFrame()
+    {
+      // skips the events of the previous frame if its steps stopped early
+      while (m_next < m_records.size() && m_records[m_next].kind != Replay::Frame)
+      {
+        ++m_next;
+      }
+
+      if (m_next == m_records.size())
+      {
+        m_finished = true;
+        return 0;
+      }
+
+      const Replay::Record &frame = m_records[m_next++];
+      m_alpha = frame.value / 65535.0;
+      ++m_frames;
+      return frame.step;
+    }
+
+    /// How far past its last step the frame begun last was drawn
+    double alpha() const
+    {
+      return m_alpha;
+    }
+
+    /// Passes the events step t_step of the current frame applied to
+    /// t_func, as SDL events
+    template<typename Func>
+    void events(int t_step, Func &t_func)
+    {
+      while (m_next < m_records.size() && m_records[m_next].kind != Replay::Frame
+             && m_records[m_next].step == t_step)
+      {
+        const Replay::Record &record = m_records[m_next++];
+        SDL_Event e;
+        memset(&e, 0, sizeof(e));
+
+        if (record.kind == Replay::Quit)
+        {
+          e.type = SDL_QUIT;
+        } else {
+          e.type = record.kind == Replay::Key_Down?SDL_KEYDOWN:SDL_KEYUP;
+          e.key.type = e.type;
+          e.key.state = record.kind == Replay::Key_Down?SDL_PRESSED:SDL_RELEASED;
+          e.key.keysym.sym = SDLKey(record.value);
+        }
+
+        t_func(e);
+      }
+    }
+
+    bool finished() const
+    {
+      return m_finished;
+    }
+
+    /// Frames played back so far
+    size_t frames() const
+    {
+      return m_frames;
+    }
+
+    /// Frames recorded
+    size_t length() const
+    {
+      return m_length;
+    }
+
+  private:
+    std::vector<Replay::Record> m_records;
+    size_t m_next; // record to read next
+    size_t m_frames;
+    size_t m_length;
+    double m_step;
+    double m_alpha;
+    bool m_finished;
+};
+
+#endif
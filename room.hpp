@@ -0,0 +1,499 @@
+#ifndef CHAIGAME_ROOM_HPP_
+#define CHAIGAME_ROOM_HPP_
+
+#include <boost/shared_ptr.hpp>
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <vector>
+
+#include "geometry.hpp"
+#include "profiler.hpp"
+#include "surface.hpp"
+#include "renderer.hpp"
+#include "object.hpp"
+#include "layer.hpp"
+
+/// Flattened list of the sprite blits of one frame, kept in a single
+/// contiguous array ordered by layer and then paint order, so submitting
+/// it is one linear pass without any shared_ptr or container chasing
+class Draw_List
+{
+  public:
+    struct Item
+    {
+      Item(size_t t_layer, const Surface *t_surface, const Rect &t_source, int t_x, int t_y)
+        : layer(t_layer), surface(t_surface), source(t_source), x(t_x), y(t_y)
+      {
+      }
+
+      size_t layer;
+      const Surface *surface;
+      Rect source; // part of surface drawn
+      int x; // target coordinates
+      int y;
+    };
+
+    /// Empties the list, keeping its storage for the next frame
+    void clear()
+    {
+      m_items.clear();
+    }
+
+    /// Items must be added in layer order, and in paint order within a layer
+    void add(const Item &t_item)
+    {
+      m_items.push_back(t_item);
+    }
+
+    /// Renders the items of t_layer, starting at t_first and skipping any
+    /// of earlier layers, and returns the index of the first item of the
+    /// following layers
+    size_t submit(Renderer &t_renderer, size_t t_layer, size_t t_first) const
+    {
+      size_t i = t_first;
+      while (i < m_items.size() && m_items[i].layer < t_layer)
+      {
+        ++i;
+      }
+
+      for (; i < m_items.size() && m_items[i].layer == t_layer; ++i)
+      {
+        const Item &item = m_items[i];
+        t_renderer.draw(*item.surface, item.source, Position(item.x, item.y));
+      }
+      return i;
+    }
+
+    size_t size() const
+    {
+      return m_items.size();
+    }
+
+  private:
+    std::vector<Item> m_items;
+};
+
+class Room
+{
+  public:
+    Room()
+      : m_center(0), m_dirty_rect_updates(false), m_buffered_entities(false), m_invalidated(true),
+        m_last_screen(0, 0, 0, 0)
+    {
+    }
+
+    void addLayer(const boost::shared_ptr<Layer> &t_layer)
+    {
+      t_layer->entities().setBuffered(m_buffered_entities);
+      m_layers.push_back(t_layer);
+      m_widths.push_back(int(t_layer->width()));
+      m_heights.push_back(int(t_layer->height()));
+      m_entity_areas.push_back(Rect(0, 0, 0, 0));
+      m_entity_revisions.push_back(t_layer->entities().revision());
+      m_center = 0;
+      invalidate();
+    }
+
+    /// In the order they were added
+    const std::vector<boost::shared_ptr<Layer> > &layers() const
+    {
+      return m_layers;
+    }
+
+    /// When enabled, render() only redraws and presents the screen areas
+    /// that changed since the previous frame, and nothing at all while the
+    /// camera and layers are still. Requires a single buffered display
+    /// surface, since the previous frame has to still be on it.
+    void setDirtyRectUpdates(bool t_enabled)
+    {
+      m_dirty_rect_updates = t_enabled;
+      invalidate();
+    }
+
+    /// Forces the next render() to redraw the whole target, e.g. after
+    /// something else drew onto it
+    void invalidate()
+    {
+      m_invalidated = true;
+    }
+
+    /// Redraws whatever was drawn from surfaces whose pixels have since been
+    /// replaced, see Asset_Cache::publish(). A layer whose image changed
+    /// size scrolls by its new size from then on.
+    void surfacesChanged(const std::vector<const Surface *> &t_changed)
+    {
+      for (size_t i = 0; i < m_layers.size(); ++i)
+      {
+        m_layers[i]->surfacesChanged(t_changed);
+
+        if (int(m_layers[i]->width()) != m_widths[i] || int(m_layers[i]->height()) != m_heights[i])
+        {
+          m_widths[i] = int(m_layers[i]->width());
+          m_heights[i] = int(m_layers[i]->height());
+          m_center = 0;
+          invalidate();
+        }
+      }
+    }
+
+    /// For simulating on another thread than the one rendering: render()
+    /// then draws every layer's entities as of the last publishEntities(),
+    /// while update() moves them on. See Entity_Store::setBuffered().
+    void setBufferedEntities(bool t_buffered)
+    {
+      m_buffered_entities = t_buffered;
+
+      for (std::vector<boost::shared_ptr<Layer> >::iterator itr = m_layers.begin();
+           itr != m_layers.end();
+           ++itr)
+      {
+        (*itr)->entities().setBuffered(t_buffered);
+      }
+    }
+
+    /// Hands the entities as simulated so far to render(), while neither
+    /// runs
+    void publishEntities()
+    {
+      for (std::vector<boost::shared_ptr<Layer> >::iterator itr = m_layers.begin();
+           itr != m_layers.end();
+           ++itr)
+      {
+        (*itr)->entities().publish();
+      }
+    }
+
+    /// Moves the entities of every layer along for one simulation step
+    void update(double t_seconds)
+    {
+      for (std::vector<boost::shared_ptr<Layer> >::iterator itr = m_layers.begin();
+           itr != m_layers.end();
+           ++itr)
+      {
+        (*itr)->entities().update(t_seconds);
+      }
+    }
+
+    /// Does up to t_budget pieces of the baking the first frames rendered
+    /// would otherwise have to, across the layers in order, see
+    /// Layer::prebake(). Returns the pieces done, fewer than t_budget once
+    /// every layer is baked.
+    size_t prebake(size_t t_budget) const
+    {
+      size_t done = 0;
+      for (std::vector<boost::shared_ptr<Layer> >::const_iterator itr = m_layers.begin();
+           itr != m_layers.end() && done < t_budget;
+           ++itr)
+      {
+        done += (*itr)->prebake(t_budget - done);
+      }
+      return done;
+    }
+
+    /// Releases what the layers can rebuild and didn't need for the last
+    /// frame rendered, see Layer::releaseCaches(). Layers hidden under an
+    /// opaque one give up all their baked copies, as do all layers when
+    /// t_shown is false, for a room not being rendered such as one baked
+    /// ahead of being entered, or when nothing was rendered since the last
+    /// layer was added. Returns the bytes released.
+    size_t releaseCaches(bool t_shown = true)
+    {
+      const bool rendered = t_shown && m_last_offsets.size() == m_layers.size();
+      const size_t base = rendered?firstShown(m_last_offsets, m_last_screen):m_layers.size();
+      size_t released = 0;
+
+      for (size_t i = 0; i < m_layers.size(); ++i)
+      {
+        const Rect viewport = i < base?Rect(0, 0, 0, 0)
+          :m_last_screen.translate(-int(floor(m_last_offsets[i].x())), -int(floor(m_last_offsets[i].y())));
+        released += m_layers[i]->releaseCaches(viewport);
+      }
+
+      return released;
+    }
+
+    /// Returns false if nothing changed and so nothing was presented
+    bool render(Renderer &t_renderer, const boost::shared_ptr<Layer> &t_center_layer,
+        const Position &t_pos_on_layer) const
+    {
+
+      if (t_center_layer.get() != m_center)
+      {
+        updateScrollFactors(t_center_layer);
+      }
+
+      const Rect screen = t_renderer.bounds();
+
+      const double xhalf = screen.w() / 2.0;
+      const double yhalf = screen.h() / 2.0;
+      const double x = t_pos_on_layer.x();
+      const double y = t_pos_on_layer.y();
+
+      std::vector<Position> &offsets = m_offsets;
+      offsets.resize(m_layers.size(), Position(0, 0));
+      m_drawn_entities.resize(m_layers.size(), Rect(0, 0, 0, 0));
+
+      for (size_t i = 0; i < offsets.size(); ++i)
+      {
+        offsets[i] = m_layers[i]->snap(Position(xhalf - x * m_scroll_x[i], yhalf - y * m_scroll_y[i]));
+      }
+
+      // Layers below one covering the whole screen can't show through it,
+      // so nothing of them is drawn or tracked
+      const size_t base = firstShown(offsets, screen);
+      std::fill(m_drawn_entities.begin(), m_drawn_entities.begin() + base, Rect(0, 0, 0, 0));
+
+      // Objects of layers that don't bake them, and every layer's entities,
+      // are drawn live on top
+      m_draw_list.clear();
+      for (size_t i = base; i < m_layers.size(); ++i)
+      {
+        const int xoffset = int(floor(offsets[i].x()));
+        const int yoffset = int(floor(offsets[i].y()));
+        const Rect visible = screen.translate(-xoffset, -yoffset);
+
+        if (!m_layers[i]->bakesObjects())
+        {
+          m_found.clear();
+          m_layers[i]->findObjects(visible, m_found);
+
+          for (std::vector<const Object_Grid::Placement *>::const_iterator itr = m_found.begin();
+               itr != m_found.end();
+               ++itr)
+          {
+            const Object &object = *(*itr)->object;
+            m_draw_list.add(Draw_List::Item(i, &object.surface(), object.area(),
+                  (*itr)->bounds.x() + xoffset, (*itr)->bounds.y() + yoffset));
+          }
+        }
+
+        Add_Entity add(m_draw_list, i, xoffset, yoffset);
+        m_layers[i]->entities().forVisible(visible, add);
+        m_drawn_entities[i] = add.area;
+      }
+
+      std::vector<Rect> changed;
+      bool full = !m_dirty_rect_updates || m_invalidated || scrolled(offsets, screen);
+
+      if (full)
+      {
+        changed.push_back(screen);
+      } else {
+        for (size_t i = base; i < m_layers.size(); ++i)
+        {
+          const std::vector<Rect> &pending = m_layers[i]->pendingChanges();
+          for (std::vector<Rect>::const_iterator itr = pending.begin();
+               itr != pending.end();
+               ++itr)
+          {
+            mergeRect(changed, onScreen(*itr, offsets[i]).intersect(screen));
+          }
+
+          // wherever entities were drawn last frame and are drawn now
+          if (m_layers[i]->entities().revision() != m_entity_revisions[i])
+          {
+            mergeRect(changed, m_entity_areas[i].unite(m_drawn_entities[i]).intersect(screen));
+          }
+        }
+
+        if (t_renderer.overlay())
+        {
+          mergeRect(changed, t_renderer.overlay()->area(screen).intersect(screen));
+        }
+
+        if (changed.empty())
+        {
+          return false;
+        }
+
+        if (!t_renderer.partialUpdates())
+        {
+          full = true;
+          changed.assign(1, screen);
+        }
+      }
+
+      for (std::vector<Rect>::const_iterator area = changed.begin();
+           area != changed.end();
+           ++area)
+      {
+        t_renderer.setClip(*area);
+
+        const size_t first = firstShown(offsets, *area);
+
+        if (first == 0 && !coveredBy(0, offsets, *area))
+        {
+          Profile_Scope scope(Profiler::Clear);
+          t_renderer.clear(*area);
+        }
+
+        size_t next = 0;
+        for (size_t i = first; i < m_layers.size(); ++i)
+        {
+          Profile_Scope scope(Profiler::Layer_Render, int(i));
+          m_layers[i]->render(t_renderer, offsets[i]);
+          next = m_draw_list.submit(t_renderer, i, next);
+        }
+      }
+
+      // changes to layers that weren't rendered are caught up on once shown
+      for (size_t i = 0; i < m_layers.size(); ++i)
+      {
+        m_layers[i]->flushChanges();
+      }
+
+      t_renderer.setClip(screen);
+      t_renderer.drawOverlay();
+
+      Profile_Scope scope(Profiler::Present);
+      if (full)
+      {
+        t_renderer.present();
+      } else {
+        t_renderer.present(changed);
+      }
+
+      std::swap(m_last_offsets, m_offsets);
+      std::swap(m_entity_areas, m_drawn_entities);
+      for (size_t i = 0; i < m_layers.size(); ++i)
+      {
+        m_entity_revisions[i] = m_layers[i]->entities().revision();
+      }
+      m_last_screen = screen;
+      m_invalidated = false;
+
+      return true;
+    }
+
+  private:
+    /// Adds the entities of a layer to the draw list, keeping track of the
+    /// screen area they cover
+    struct Add_Entity
+    {
+      Add_Entity(Draw_List &t_list, size_t t_layer, int t_xoffset, int t_yoffset)
+        : list(t_list), layer(t_layer), xoffset(t_xoffset), yoffset(t_yoffset), area(0, 0, 0, 0)
+      {
+      }
+
+      void operator()(const Object &t_object, int t_x, int t_y)
+      {
+        const Rect source = t_object.area();
+        const Rect drawn(t_x + xoffset, t_y + yoffset, source.w(), source.h());
+        list.add(Draw_List::Item(layer, &t_object.surface(), source, drawn.x(), drawn.y()));
+        area = area.unite(drawn);
+      }
+
+      Draw_List &list;
+      size_t layer;
+      int xoffset;
+      int yoffset;
+      Rect area;
+    };
+
+    /// Works out how far each layer scrolls per pixel the camera moves on
+    /// t_center_layer, so a frame's offsets are one multiply per layer
+    void updateScrollFactors(const boost::shared_ptr<Layer> &t_center_layer) const
+    {
+      std::vector<boost::shared_ptr<Layer> >::const_iterator foundlayer =
+        std::find(m_layers.begin(), m_layers.end(), t_center_layer);
+
+      if (foundlayer == m_layers.end())
+      {
+        throw std::runtime_error("Requested center layer doesn't exist in room");
+      }
+
+      const size_t center = foundlayer - m_layers.begin();
+
+      m_scroll_x.resize(m_layers.size());
+      m_scroll_y.resize(m_layers.size());
+
+      for (size_t i = 0; i < m_layers.size(); ++i)
+      {
+        m_scroll_x[i] = double(m_widths[i]) / m_widths[center];
+        m_scroll_y[i] = double(m_heights[i]) / m_heights[center];
+      }
+
+      m_center = t_center_layer.get();
+    }
+
+    /// Screen area touched by t_area of a layer rendered at t_offset, one
+    /// pixel larger when the offset is fractional since the layer's
+    /// pre-shifted copies are then filtered into the next pixel
+    static Rect onScreen(const Rect &t_area, const Position &t_offset)
+    {
+      const int x = int(floor(t_offset.x()));
+      const int y = int(floor(t_offset.y()));
+      return Rect(t_area.x() + x, t_area.y() + y,
+          t_area.w() + (x != t_offset.x()), t_area.h() + (y != t_offset.y()));
+    }
+
+    /// True if any layer moved since the last frame, by what it can show:
+    /// whole pixels or sub-pixel steps
+    bool scrolled(const std::vector<Position> &t_offsets, const Rect &t_screen) const
+    {
+      if (t_offsets.size() != m_last_offsets.size()
+          || t_screen.w() != m_last_screen.w() || t_screen.h() != m_last_screen.h())
+      {
+        return true;
+      }
+
+      for (size_t i = 0; i < t_offsets.size(); ++i)
+      {
+        if (t_offsets[i].x() != m_last_offsets[i].x() || t_offsets[i].y() != m_last_offsets[i].y())
+        {
+          return true;
+        }
+      }
+
+      return false;
+    }
+
+    /// True if layer t_layer is opaque and covers all of t_area
+    bool coveredBy(size_t t_layer, const std::vector<Position> &t_offsets, const Rect &t_area) const
+    {
+      const Rect area = Rect(0, 0, m_widths[t_layer], m_heights[t_layer])
+        .translate(int(floor(t_offsets[t_layer].x())), int(floor(t_offsets[t_layer].y())));
+
+      return m_layers[t_layer]->opaque() && area.intersect(t_area) == t_area;
+    }
+
+    /// The lowest layer that can be seen in t_area: the topmost opaque layer
+    /// covering all of it, which hides every layer below, or 0
+    size_t firstShown(const std::vector<Position> &t_offsets, const Rect &t_area) const
+    {
+      for (size_t i = m_layers.size(); i > 0; --i)
+      {
+        if (coveredBy(i - 1, t_offsets, t_area))
+        {
+          return i - 1;
+        }
+      }
+
+      return 0;
+    }
+
+    std::vector<boost::shared_ptr<Layer> > m_layers;
+
+    // per layer, in the order of m_layers
+    std::vector<int> m_widths;
+    std::vector<int> m_heights;
+    mutable std::vector<double> m_scroll_x; // relative to the center layer
+    mutable std::vector<double> m_scroll_y;
+    mutable const Layer *m_center; // layer the scroll factors were worked out for, NULL if stale
+
+    bool m_dirty_rect_updates;
+    bool m_buffered_entities;
+    mutable bool m_invalidated;
+    mutable std::vector<Position> m_offsets;
+    mutable std::vector<Position> m_last_offsets;
+    mutable std::vector<Rect> m_entity_areas; // screen area covered by each layer's entities last frame
+    mutable std::vector<Rect> m_drawn_entities; // and this frame
+    mutable std::vector<unsigned> m_entity_revisions; // of each layer's entities last frame
+    mutable Rect m_last_screen;
+
+    mutable Draw_List m_draw_list;
+    mutable std::vector<const Object_Grid::Placement *> m_found;
+};
+
+#endif
@@ -0,0 +1,454 @@
+#ifndef CHAIGAME_ROOM_PACK_HPP_
+#define CHAIGAME_ROOM_PACK_HPP_
+
+#include <SDL/SDL.h>
+#include <boost/shared_ptr.hpp>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "geometry.hpp"
+#include "mapped_file.hpp"
+#include "surface.hpp"
+#include "object.hpp"
+#include "layer.hpp"
+#include "room.hpp"
+
+/// A room's layers, objects and images in one binary file, with the pixels
+/// already in the display format they were written in.
+/// Loading maps the file and builds the layers around the mapped pixels, so
+/// nothing is decoded and nothing is copied beyond the layers' own baked
+/// tiles; pixels are paged in as they are first drawn. Images whose format
+/// no longer matches the display are converted into copies instead.
+/// Packs are meant to be written and read on the same kind of machine, the
+/// byte order and layout are native.
+class Room_Pack
+{
+  public:
+    /// Maps and validates t_filename and builds its layers
+    explicit Room_Pack(const std::string &t_filename)
+      : m_file(new Mapped_File(t_filename)), m_converted(0)
+    {
+      const Uint8 *data = static_cast<const Uint8 *>(m_file->data());
+      const Header &header = *reinterpret_cast<const Header *>(data);
+
+      if (m_file->size() < sizeof(Header)
+          || memcmp(header.magic, "CGRP", 4) != 0
+          || header.byte_order != Byte_Order
+          || header.version != Version)
+      {
+        throw std::runtime_error("Not a room pack, or from another version: " + t_filename);
+      }
+
+      const size_t tables = sizeof(Header) + header.images * sizeof(Image) + header.objects * sizeof(Object_Record)
+        + header.layers * sizeof(Layer_Record) + header.placements * sizeof(Placement_Record);
+
+      if (tables > m_file->size())
+      {
+        throw std::runtime_error("Truncated room pack: " + t_filename);
+      }
+
+      // the placements come first, where their doubles are aligned
+      const Placement_Record *placements = reinterpret_cast<const Placement_Record *>(data + sizeof(Header));
+      const Image *images = reinterpret_cast<const Image *>(placements + header.placements);
+      const Object_Record *objects = reinterpret_cast<const Object_Record *>(images + header.images);
+      const Layer_Record *layers = reinterpret_cast<const Layer_Record *>(objects + header.objects);
+
+      if (reinterpret_cast<size_t>(placements) % sizeof(double) != 0)
+      {
+        throw std::runtime_error("Misaligned room pack mapping: " + t_filename);
+      }
+
+      std::vector<boost::shared_ptr<const Surface> > surfaces;
+      for (Uint32 i = 0; i < header.images; ++i)
+      {
+        if (images[i].offset + size_t(images[i].pitch) * images[i].height > m_file->size())
+        {
+          throw std::runtime_error("Truncated room pack: " + t_filename);
+        }
+
+        surfaces.push_back(load(images[i], t_filename));
+      }
+
+      std::vector<boost::shared_ptr<Object> > sprites;
+      for (Uint32 i = 0; i < header.objects; ++i)
+      {
+        const Object_Record &record = objects[i];
+        sprites.push_back(boost::shared_ptr<Object>(new Object(surfaces.at(record.image),
+                Rect(int(record.x), int(record.y), int(record.width), int(record.height)))));
+      }
+
+      for (Uint32 i = 0; i < header.layers; ++i)
+      {
+        const Layer_Record &record = layers[i];
+
+        if (record.first_placement + record.placements > header.placements)
+        {
+          throw std::runtime_error("Corrupt room pack: " + t_filename);
+        }
+
+        boost::shared_ptr<Layer> layer(new Layer(surfaces.at(record.image)));
+        layer->setBakeObjects(record.bake_objects != 0);
+        layer->setSubpixelSteps(int(record.subpixel_steps));
+        layer->reserveObjects(record.placements);
+
+        for (Uint32 p = record.first_placement; p < record.first_placement + record.placements; ++p)
+        {
+          layer->addObject(Position(placements[p].x, placements[p].y), sprites.at(placements[p].object),
+              placements[p].flags);
+        }
+
+        m_layers.push_back(layer);
+      }
+    }
+
+    /// In the order they were added to the room that was written
+    const std::vector<boost::shared_ptr<Layer> > &layers() const
+    {
+      return m_layers;
+    }
+
+    void addTo(Room &t_room) const
+    {
+      for (std::vector<boost::shared_ptr<Layer> >::const_iterator itr = m_layers.begin();
+           itr != m_layers.end();
+           ++itr)
+      {
+        t_room.addLayer(*itr);
+      }
+    }
+
+    /// Images that had to be converted to the current display format
+    size_t converted() const
+    {
+      return m_converted;
+    }
+
+    size_t mappedBytes() const
+    {
+      return m_file->size();
+    }
+
+    /// Writes every layer of t_room with its objects and the images they
+    /// use. Chunked layers can't be packed.
+    static void write(const std::string &t_filename, const Room &t_room)
+    {
+      Header header;
+      memcpy(header.magic, "CGRP", 4);
+      header.byte_order = Byte_Order;
+      header.version = Version;
+
+      std::vector<const Surface *> surfaces;
+      std::map<const Surface *, Uint32> surface_ids;
+      std::vector<Object_Record> objects;
+      std::map<const Object *, Uint32> object_ids;
+      std::vector<Layer_Record> layers;
+      std::vector<Placement_Record> placements;
+
+      const std::vector<boost::shared_ptr<Layer> > &room_layers = t_room.layers();
+      for (std::vector<boost::shared_ptr<Layer> >::const_iterator layer = room_layers.begin();
+           layer != room_layers.end();
+           ++layer)
+      {
+        if (!(*layer)->image())
+        {
+          throw std::runtime_error("Chunked layers can't be written to a room pack: " + t_filename);
+        }
+
+        Layer_Record record;
+        record.image = id(surface_ids, surfaces, (*layer)->image().get());
+        record.first_placement = Uint32(placements.size());
+        record.placements = Uint32((*layer)->objects().size());
+        record.subpixel_steps = Uint32((*layer)->subpixelSteps());
+        record.bake_objects = (*layer)->bakesObjects()?1:0;
+        layers.push_back(record);
+
+        const std::vector<Object_Grid::Placement> &placed = (*layer)->objects().placements();
+        for (std::vector<Object_Grid::Placement>::const_iterator itr = placed.begin();
+             itr != placed.end();
+             ++itr)
+        {
+          std::map<const Object *, Uint32>::const_iterator known = object_ids.find(itr->object);
+
+          if (known == object_ids.end())
+          {
+            const Rect area = itr->object->area();
+            Object_Record object;
+            object.image = id(surface_ids, surfaces, &itr->object->surface());
+            object.x = Uint32(area.x());
+            object.y = Uint32(area.y());
+            object.width = Uint32(area.w());
+            object.height = Uint32(area.h());
+            known = object_ids.insert(std::make_pair(itr->object, Uint32(objects.size()))).first;
+            objects.push_back(object);
+          }
+
+          Placement_Record placement;
+          placement.object = known->second;
+          placement.flags = itr->flags;
+          placement.x = itr->position.x();
+          placement.y = itr->position.y();
+          placements.push_back(placement);
+        }
+      }
+
+      header.images = Uint32(surfaces.size());
+      header.objects = Uint32(objects.size());
+      header.layers = Uint32(layers.size());
+      header.placements = Uint32(placements.size());
+
+      // pixels follow the tables, each image's rows aligned for the SIMD
+      // kernels
+      size_t offset = align(sizeof(Header) + surfaces.size() * sizeof(Image) + objects.size() * sizeof(Object_Record)
+          + layers.size() * sizeof(Layer_Record) + placements.size() * sizeof(Placement_Record));
+
+      std::vector<Image> images;
+      for (std::vector<const Surface *>::const_iterator itr = surfaces.begin();
+           itr != surfaces.end();
+           ++itr)
+      {
+        images.push_back(describe((*itr)->m_surface, offset));
+        offset = align(offset + size_t(images.back().pitch) * images.back().height);
+      }
+
+      std::ofstream file(t_filename.c_str(), std::ios::binary | std::ios::trunc);
+      write(file, &header, 1);
+      write(file, placements.empty()?0:&placements.front(), placements.size());
+      write(file, images.empty()?0:&images.front(), images.size());
+      write(file, objects.empty()?0:&objects.front(), objects.size());
+      write(file, layers.empty()?0:&layers.front(), layers.size());
+
+      for (size_t i = 0; i < surfaces.size(); ++i)
+      {
+        pad(file, images[i].offset);
+        writePixels(file, surfaces[i]->m_surface, images[i].pitch);
+      }
+
+      if (!file.flush())
+      {
+        throw std::runtime_error("Unable to write room pack: " + t_filename);
+      }
+    }
+
+  private:
+    Room_Pack(const Room_Pack &);
+    Room_Pack &operator=(const Room_Pack &);
+
+    static const Uint32 Version = 3;
+    static const Uint32 Byte_Order = 0x01020304;
+    static const size_t Alignment = 32;
+
+    enum Image_Flags
+    {
+      Alpha = 1, // per-pixel or per-surface alpha blending
+      Colour_Key = 2,
+      RLE = 4
+    };
+
+    /// A multiple of 8 bytes, so the Placement_Records following it are
+    /// aligned for their doubles
+    struct Header
+    {
+      char magic[4];
+      Uint32 byte_order;
+      Uint32 version;
+      Uint32 images;
+      Uint32 objects;
+      Uint32 layers;
+      Uint32 placements;
+      Uint32 reserved;
+    };
+
+    struct Image
+    {
+      Uint32 offset; // of the pixels from the start of the file
+      Uint32 width;
+      Uint32 height;
+      Uint32 pitch;
+      Uint32 bits;
+      Uint32 rmask;
+      Uint32 gmask;
+      Uint32 bmask;
+      Uint32 amask;
+      Uint32 flags; // Image_Flags
+      Uint32 colour_key;
+      Uint32 alpha; // per-surface alpha
+    };
+
+    struct Object_Record
+    {
+      Uint32 image;
+      Uint32 x; // part of the image drawn, e.g. a sprite on an atlas page
+      Uint32 y;
+      Uint32 width;
+      Uint32 height;
+    };
+
+    struct Layer_Record
+    {
+      Uint32 image;
+      Uint32 first_placement;
+      Uint32 placements;
+      Uint32 subpixel_steps;
+      Uint32 bake_objects;
+    };
+
+    struct Placement_Record
+    {
+      Uint32 object;
+      Uint32 flags; // Object_Grid::Placement::Flags
+      double x;
+      double y;
+    };
+
+    /// Releases the mapping along with the last surface pointing into it
+    struct Release_Mapped
+    {
+      Release_Mapped(const boost::shared_ptr<Mapped_File> &t_file)
+        : file(t_file)
+      {
+      }
+
+      void operator()(const Surface *t_surface) const
+      {
+        delete t_surface;
+      }
+
+      boost::shared_ptr<Mapped_File> file;
+    };
+
+    boost::shared_ptr<const Surface> load(const Image &t_image, const std::string &t_filename)
+    {
+      void *pixels = static_cast<Uint8 *>(m_file->data()) + t_image.offset;
+      SDL_Surface *mapped = SDL_CreateRGBSurfaceFrom(pixels, int(t_image.width), int(t_image.height),
+          int(t_image.bits), int(t_image.pitch), t_image.rmask, t_image.gmask, t_image.bmask, t_image.amask);
+
+      if (!mapped)
+      {
+        throw std::runtime_error(std::string("Unable to create surface: ") + SDL_GetError());
+      }
+
+      const bool rle = (t_image.flags & RLE) != 0;
+
+      // set before any conversion, which carries them over
+      if (t_image.flags & Colour_Key)
+      {
+        SDL_SetColorKey(mapped, SDL_SRCCOLORKEY | (rle?SDL_RLEACCEL:0), t_image.colour_key);
+      }
+
+      if (t_image.flags & Alpha)
+      {
+        SDL_SetAlpha(mapped, SDL_SRCALPHA | (rle?SDL_RLEACCEL:0), Uint8(t_image.alpha));
+      } else {
+        SDL_SetAlpha(mapped, 0, SDL_ALPHA_OPAQUE);
+      }
+
+      if (!displayFormat(mapped->format, t_image.amask != 0))
+      {
+        // converting frees the mapped surface but not the pixels, which
+        // belong to the mapping
+        ++m_converted;
+        return boost::shared_ptr<const Surface>(new Surface(mapped, t_filename, rle));
+      }
+
+      return boost::shared_ptr<const Surface>(new Surface(mapped), Release_Mapped(m_file));
+    }
+
+    /// True if t_format is what the display would convert an image to
+    static bool displayFormat(const SDL_PixelFormat *t_format, bool t_alpha)
+    {
+      SDL_Surface *display = Surface::createDisplayFormat(1, 1, t_alpha);
+      const SDL_PixelFormat *format = display->format;
+      const bool same = format->BitsPerPixel == t_format->BitsPerPixel
+        && format->Rmask == t_format->Rmask && format->Gmask == t_format->Gmask
+        && format->Bmask == t_format->Bmask && format->Amask == t_format->Amask;
+      SDL_FreeSurface(display);
+      return same;
+    }
+
+    static Image describe(const SDL_Surface *t_surface, size_t t_offset)
+    {
+      const SDL_PixelFormat *format = t_surface->format;
+
+      Image image;
+      image.offset = Uint32(t_offset);
+      image.width = Uint32(t_surface->w);
+      image.height = Uint32(t_surface->h);
+      image.pitch = Uint32(align(size_t(t_surface->w) * format->BytesPerPixel));
+      image.bits = format->BitsPerPixel;
+      image.rmask = format->Rmask;
+      image.gmask = format->Gmask;
+      image.bmask = format->Bmask;
+      image.amask = format->Amask;
+      image.flags = ((t_surface->flags & SDL_SRCALPHA)?Alpha:0)
+        | ((t_surface->flags & SDL_SRCCOLORKEY)?Colour_Key:0)
+        | ((t_surface->flags & SDL_RLEACCEL)?RLE:0);
+      image.colour_key = format->colorkey;
+      image.alpha = format->alpha;
+
+      if (t_offset + size_t(image.pitch) * image.height > 0xffffffffu)
+      {
+        throw std::runtime_error("Room pack would exceed 4GB");
+      }
+
+      return image;
+    }
+
+    static Uint32 id(std::map<const Surface *, Uint32> &t_ids, std::vector<const Surface *> &t_surfaces,
+        const Surface *t_surface)
+    {
+      std::map<const Surface *, Uint32>::const_iterator itr = t_ids.find(t_surface);
+
+      if (itr != t_ids.end())
+      {
+        return itr->second;
+      }
+
+      t_ids.insert(std::make_pair(t_surface, Uint32(t_surfaces.size())));
+      t_surfaces.push_back(t_surface);
+      return Uint32(t_surfaces.size() - 1);
+    }
+
+    static size_t align(size_t t_offset)
+    {
+      return (t_offset + Alignment - 1) / Alignment * Alignment;
+    }
+
+    template<typename T>
+    static void write(std::ofstream &t_file, const T *t_records, size_t t_count)
+    {
+      t_file.write(reinterpret_cast<const char *>(t_records), std::streamsize(t_count * sizeof(T)));
+    }
+
+    static void pad(std::ofstream &t_file, size_t t_offset)
+    {
+      static const char zeros[Alignment] = {0};
+      t_file.write(zeros, std::streamsize(t_offset - size_t(t_file.tellp())));
+    }
+
+    static void writePixels(std::ofstream &t_file, SDL_Surface *t_surface, size_t t_pitch)
+    {
+      // locking decodes RLE surfaces back into plain pixels
+      SDL_LockSurface(t_surface);
+
+      const size_t row = size_t(t_surface->w) * t_surface->format->BytesPerPixel;
+      std::vector<char> padded(t_pitch, 0);
+
+      for (int y = 0; y < t_surface->h; ++y)
+      {
+        memcpy(&padded.front(), static_cast<const char *>(t_surface->pixels) + y * t_surface->pitch, row);
+        t_file.write(&padded.front(), std::streamsize(t_pitch));
+      }
+
+      SDL_UnlockSurface(t_surface);
+    }
+
+    boost::shared_ptr<Mapped_File> m_file;
+    size_t m_converted;
+    std::vector<boost::shared_ptr<Layer> > m_layers;
+};
+
+#endif
@@ -0,0 +1,172 @@
+#ifndef CHAIGAME_SCREEN_HPP_
+#define CHAIGAME_SCREEN_HPP_
+
+#include <SDL/SDL.h>
+#include <boost/shared_ptr.hpp>
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+#include "surface.hpp"
+#include "renderer.hpp"
+#include "banded_renderer.hpp"
+
+/// How the display is set up
+struct Video_Mode
+{
+  Video_Mode()
+    : width(640), height(480), bpp(32), fullscreen(false), double_buffered(false),
+      internal_width(0), internal_height(0)
+  {
+  }
+
+  int width; // 0 for the desktop's size
+  int height;
+  int bpp; // 0 for the desktop's depth
+  bool fullscreen;
+  bool double_buffered; // rules out partial updates, every frame is redrawn
+
+  /// Frames are rendered at this size and enlarged by the largest whole
+  /// factor that fits the display, centred. 0 to render at display size.
+  int internal_width;
+  int internal_height;
+};
+
+class Screen
+{
+  public:
+    enum Backend
+    {
+      Software,
+      OpenGL
+    };
+
+    /// Falls back to the software backend if OpenGL is not available.
+    /// The software backend composites on t_render_threads threads.
+    Screen(Backend t_backend = Software, int t_render_threads = 1, const Video_Mode &t_mode = Video_Mode())
+      : m_initializer(), m_backend(t_backend), m_surface(setVideoMode(m_backend, t_mode))
+    {
+      m_surface.setCategory(Surface_Memory::Screen);
+      const Rect display = m_surface.bounds();
+      Rect internal = display;
+      int factor = 1;
+
+      if (t_mode.internal_width > 0 && t_mode.internal_height > 0)
+      {
+        factor = std::max(std::min(display.w() / t_mode.internal_width, display.h() / t_mode.internal_height), 1);
+        internal = Rect(0, 0, std::min(t_mode.internal_width, display.w()), std::min(t_mode.internal_height, display.h()));
+      }
+
+      const Rect viewport((display.w() - internal.w() * factor) / 2, (display.h() - internal.h() * factor) / 2,
+          internal.w() * factor, internal.h() * factor);
+
+#ifdef CHAIGAME_HAS_OPENGL
+      if (m_backend == OpenGL)
+      {
+        m_renderer.reset(new OpenGL_Renderer(internal.w(), internal.h(), viewport, display));
+      }
+#endif
+
+      Surface *target = &m_surface;
+
+      if (!m_renderer && (internal.w() != display.w() || internal.h() != display.h()))
+      {
+        m_internal.reset(new Surface(internal.w(), internal.h(), false));
+        m_internal->setCategory(Surface_Memory::Screen);
+        target = m_internal.get();
+      }
+
+      if (!m_renderer && t_render_threads > 1)
+      {
+        m_renderer.reset(new Banded_Renderer(*target, t_render_threads));
+      }
+
+      if (!m_renderer)
+      {
+        m_renderer.reset(new Software_Renderer(*target));
+      }
+
+      if (m_internal)
+      {
+        // black borders, on both buffers if there are two
+        for (int i = 0; i < (m_surface.doubleBuffered()?2:1); ++i)
+        {
+          m_surface.fill(display, 0, 0, 0);
+          m_surface.flip();
+        }
+
+        m_renderer.reset(new Scaled_Renderer(m_renderer, *m_internal, m_surface, factor, viewport.x(), viewport.y()));
+      }
+    }
+
+    /// The display surface
+    Surface &getSurface()
+    {
+      return m_surface;
+    }
+
+    Renderer &getRenderer()
+    {
+      return *m_renderer;
+    }
+
+    Backend backend() const
+    {
+      return m_backend;
+    }
+
+  private:
+    struct Initializer
+    {
+      Initializer()
+      {
+        if ( SDL_Init(SDL_INIT_AUDIO|SDL_INIT_VIDEO|SDL_INIT_TIMER) < 0 ) {
+          throw std::runtime_error(std::string("Unable to init SDL: ") + SDL_GetError());
+        }
+      }
+
+      ~Initializer()
+      {
+        SDL_Quit();
+      }
+    };
+
+    static SDL_Surface *setVideoMode(Backend &t_backend, const Video_Mode &t_mode)
+    {
+      const Uint32 fullscreen = t_mode.fullscreen?SDL_FULLSCREEN:0;
+
+#ifdef CHAIGAME_HAS_OPENGL
+      if (t_backend == OpenGL)
+      {
+        SDL_GL_SetAttribute(SDL_GL_DOUBLEBUFFER, 1);
+        SDL_GL_SetAttribute(SDL_GL_SWAP_CONTROL, 1);
+        SDL_Surface *surface = SDL_SetVideoMode(t_mode.width, t_mode.height, t_mode.bpp, SDL_OPENGL | fullscreen);
+        if (surface)
+        {
+          return surface;
+        }
+        std::cerr << "OpenGL unavailable, using software rendering: " << SDL_GetError() << std::endl;
+      }
+#endif
+
+      t_backend = Software;
+      SDL_Surface *surface = SDL_SetVideoMode(t_mode.width, t_mode.height, t_mode.bpp,
+          SDL_HWSURFACE | SDL_HWACCEL | fullscreen | (t_mode.double_buffered?SDL_DOUBLEBUF:0));
+
+      if (!surface)
+      {
+        throw std::runtime_error(std::string("Unable to set video mode: ") + SDL_GetError());
+      }
+
+      return surface;
+    }
+
+    Initializer m_initializer;
+    Backend m_backend;
+    Surface m_surface;
+    boost::shared_ptr<Surface> m_internal; // rendered onto and enlarged to the display, NULL if not scaling
+    boost::shared_ptr<Renderer> m_renderer;
+};
+
+#endif
@@ -0,0 +1,137 @@
+#ifndef CHAIGAME_SCRIPT_HPP_
+#define CHAIGAME_SCRIPT_HPP_
+
+#ifdef CHAIGAME_HAS_CHAISCRIPT
+
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <chaiscript/chaiscript.hpp>
+#include <string>
+
+#include "geometry.hpp"
+#include "surface.hpp"
+#include "asset_cache.hpp"
+#include "object.hpp"
+#include "layer.hpp"
+#include "room.hpp"
+
+/// Game logic written in ChaiScript, with the room building blocks exposed
+/// to it.
+/// The script is parsed once, when loaded. The functions the game calls
+/// into are looked up once with hook() and then called like any other
+/// function, so a tick never parses or looks anything up by name. Hooks are
+/// meant to be handed whole collections to work through, not to be called
+/// once per object.
+class Script
+{
+  public:
+    explicit Script(const std::string &t_filename)
+    {
+      addTypes();
+      m_chai.eval_file(t_filename);
+    }
+
+    /// The script function t_name, callable directly. Empty if the script
+    /// doesn't define it, throws if it isn't callable as Signature.
+    template<typename Signature>
+    boost::function<Signature> hook(const std::string &t_name)
+    {
+      chaiscript::Boxed_Value value;
+
+      try {
+        value = m_chai.eval(t_name);
+      } catch (const chaiscript::exception::eval_error &e) {
+        if (e.reason == "Can not find object: " + t_name)
+        {
+          return boost::function<Signature>();
+        }
+        throw;
+      }
+
+      return chaiscript::boxed_cast<boost::function<Signature> >(value);
+    }
+
+    /// For exposing the game's own types
+    chaiscript::ChaiScript &engine()
+    {
+      return m_chai;
+    }
+
+  private:
+    Script(const Script &);
+    Script &operator=(const Script &);
+
+    void addTypes()
+    {
+      using namespace chaiscript;
+
+      m_chai.add(user_type<Position>(), "Position");
+      m_chai.add(constructor<Position (double, double)>(), "Position");
+      m_chai.add(constructor<Position (const Position &)>(), "Position");
+      m_chai.add(fun(static_cast<double &(Position::*)()>(&Position::x)), "x");
+      m_chai.add(fun(static_cast<double &(Position::*)()>(&Position::y)), "y");
+      m_chai.add(fun(&Position::operator+), "+");
+
+      m_chai.add(user_type<Rect>(), "Rect");
+      m_chai.add(constructor<Rect (int, int, int, int)>(), "Rect");
+      m_chai.add(fun(&Rect::x), "x");
+      m_chai.add(fun(&Rect::y), "y");
+      m_chai.add(fun(&Rect::w), "w");
+      m_chai.add(fun(&Rect::h), "h");
+      m_chai.add(fun(&Rect::intersects), "intersects");
+
+      m_chai.add(user_type<Surface>(), "Surface");
+      m_chai.add(fun(&Surface::width), "width");
+      m_chai.add(fun(&Surface::height), "height");
+
+      m_chai.add(user_type<Asset_Cache>(), "Asset_Cache");
+      m_chai.add(fun(&Asset_Cache::get), "get");
+      m_chai.add(fun(&Asset_Cache::request), "request");
+
+      m_chai.add(user_type<Object>(), "Object");
+      m_chai.add(constructor<Object (const boost::shared_ptr<const Surface> &)>(), "Object");
+      m_chai.add(constructor<Object (const boost::shared_ptr<const Surface> &, const Rect &)>(), "Object");
+
+      m_chai.add(user_type<Layer>(), "Layer");
+      m_chai.add(constructor<Layer (const boost::shared_ptr<const Surface> &)>(), "Layer");
+      m_chai.add(fun(&Layer::addObject), "addObject");
+      m_chai.add(fun(&Script::addObject), "addObject");
+      m_chai.add(fun(static_cast<void (Layer::*)(Object_Handle, Position)>(&Layer::moveObject)), "moveObject");
+      m_chai.add(fun(static_cast<void (Layer::*)(Object_Handle)>(&Layer::removeObject)), "removeObject");
+      m_chai.add(fun(&Layer::setObjectFlags), "setObjectFlags");
+      m_chai.add(fun(&Layer::objectCount), "objectCount");
+      m_chai.add(fun(&Layer::setBakeObjects), "setBakeObjects");
+      m_chai.add(fun(&Layer::setSubpixelSteps), "setSubpixelSteps");
+      m_chai.add(fun(static_cast<Entity_Store &(Layer::*)()>(&Layer::entities)), "entities");
+      m_chai.add(fun(&Layer::width), "width");
+      m_chai.add(fun(&Layer::height), "height");
+
+      // scripts set entities going, the store moves all of them natively
+      m_chai.add(user_type<Entity_Store>(), "Entity_Store");
+      m_chai.add(fun(static_cast<unsigned (Entity_Store::*)(const boost::shared_ptr<const Surface> &)>(&Entity_Store::addSprite)), "addSprite");
+      m_chai.add(fun(&Entity_Store::create), "create");
+      m_chai.add(fun(&Entity_Store::destroy), "destroy");
+      m_chai.add(fun(&Entity_Store::position), "position");
+      m_chai.add(fun(&Entity_Store::setPosition), "setPosition");
+      m_chai.add(fun(&Entity_Store::velocity), "velocity");
+      m_chai.add(fun(&Entity_Store::setVelocity), "setVelocity");
+      m_chai.add(fun(&Entity_Store::setWrap), "setWrap");
+      m_chai.add(fun(&Entity_Store::size), "size");
+
+      m_chai.add(user_type<Room>(), "Room");
+      m_chai.add(fun(&Room::addLayer), "addLayer");
+      m_chai.add(fun(&Room::setDirtyRectUpdates), "setDirtyRectUpdates");
+    }
+
+    /// Without flags, the default argument doesn't carry over to the script
+    static Object_Handle addObject(Layer &t_layer, const Position &t_p, const boost::shared_ptr<Object> &t_obj)
+    {
+      return t_layer.addObject(t_p, t_obj);
+    }
+
+    chaiscript::ChaiScript m_chai;
+};
+
+#endif
+
+#endif
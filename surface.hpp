@@ -0,0 +1,706 @@
+#ifndef CHAIGAME_SURFACE_HPP_
+#define CHAIGAME_SURFACE_HPP_
+
+#include <SDL/SDL.h>
+#include <SDL/SDL_image.h>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+
+#include "geometry.hpp"
+#include "profiler.hpp"
+#include "pixel_kernels.hpp"
+#include "surface_memory.hpp"
+
+class Surface
+{
+  public:
+    typedef char* (*ErrorFunc)();
+
+    Surface(SDL_Surface *t_surf)
+      : m_surface(t_surf), m_serial(nextSerial()), m_revision(0), m_category(Surface_Memory::Image)
+    {
+      if (!m_surface)
+      {
+        throw std::runtime_error(SDL_GetError());
+      }
+      surfaceMemory().add(m_category, bytes());
+    }
+
+    Surface(SDL_Surface *t_surf, ErrorFunc t_errfunc)
+      : m_surface(t_surf), m_serial(nextSerial()), m_revision(0), m_category(Surface_Memory::Image)
+    {
+      if (!m_surface)
+      {
+        throw std::runtime_error(t_errfunc());
+      }
+      surfaceMemory().add(m_category, bytes());
+    }
+
+    /// Loads an image and converts it once to the display pixel format, so
+    /// that blits from it never have to convert per pixel.
+    /// Images with translucent pixels keep a per-pixel alpha channel, all
+    /// others become opaque (preserving any colour key).
+    /// t_rle enables RLE acceleration, which is worthwhile for sprites that
+    /// are only ever blitted from, never rendered onto.
+    Surface(const std::string &t_filename, bool t_rle)
+      : m_surface(toDisplayFormat(IMG_Load(t_filename.c_str()), t_filename, t_rle)),
+        m_serial(nextSerial()), m_revision(0), m_category(Surface_Memory::Image)
+    {
+      surfaceMemory().add(m_category, bytes());
+    }
+
+    /// Takes ownership of an already decoded image and converts it to the
+    /// display pixel format, as above
+    Surface(SDL_Surface *t_decoded, const std::string &t_name, bool t_rle)
+      : m_surface(toDisplayFormat(t_decoded, t_name, t_rle)),
+        m_serial(nextSerial()), m_revision(0), m_category(Surface_Memory::Image)
+    {
+      surfaceMemory().add(m_category, bytes());
+    }
+
+    /// Blank surface in the display pixel format, fully transparent if it
+    /// has an alpha channel, black otherwise
+    Surface(int t_width, int t_height, bool t_alpha)
+      : m_surface(createDisplayFormat(t_width, t_height, t_alpha)),
+        m_serial(nextSerial()), m_revision(0), m_category(Surface_Memory::Image)
+    {
+      surfaceMemory().add(m_category, bytes());
+    }
+
+    /// Deep copy, the new surface owns its own pixels and counts towards
+    /// the same category
+    Surface(const Surface &t_other)
+      : m_surface(SDL_ConvertSurface(t_other.m_surface, t_other.m_surface->format,
+            t_other.m_surface->flags & ~SDL_RLEACCEL)),
+        m_serial(nextSerial()), m_revision(0), m_category(t_other.m_category)
+    {
+      if (!m_surface)
+      {
+        throw std::runtime_error(SDL_GetError());
+      }
+      surfaceMemory().add(m_category, bytes());
+    }
+
+    void clear()
+    {
+      SDL_Rect dest;
+      dest.x=0;
+      dest.y=0;
+      dest.w=m_surface->w;
+      dest.h=m_surface->h;
+//      SDL_SetAlpha(m_surface, SDL_SRCALPHA, SDL_ALPHA_OPAQUE);
+      fillRect(m_surface, dest, SDL_MapRGBA(m_surface->format, 0, 0, 0, SDL_ALPHA_TRANSPARENT));
+      ++m_revision;
+    }
+
+    void fill(const Rect &t_area, Uint8 t_r, Uint8 t_g, Uint8 t_b)
+    {
+      SDL_Rect dest = t_area.toSDL();
+      fillRect(m_surface, dest, SDL_MapRGBA(m_surface->format, t_r, t_g, t_b, SDL_ALPHA_OPAQUE));
+      ++m_revision;
+    }
+
+    /// Clears just t_area
+    void clear(const Rect &t_area)
+    {
+      fillRect(m_surface, t_area.toSDL(), SDL_MapRGBA(m_surface->format, 0, 0, 0, SDL_ALPHA_TRANSPARENT));
+      ++m_revision;
+    }
+
+    void flip()
+    {
+      SDL_Flip(m_surface);
+    }
+
+    /// Presents only the given areas of a display surface
+    void update(const std::vector<Rect> &t_areas)
+    {
+      std::vector<SDL_Rect> rects;
+      for (std::vector<Rect>::const_iterator itr = t_areas.begin();
+           itr != t_areas.end();
+           ++itr)
+      {
+        rects.push_back(itr->toSDL());
+      }
+
+      if (!rects.empty())
+      {
+        SDL_UpdateRects(m_surface, int(rects.size()), &rects.front());
+      }
+    }
+
+    /// Restricts all rendering onto this surface to t_area
+    void setClip(const Rect &t_area)
+    {
+      SDL_Rect clip = t_area.toSDL();
+      SDL_SetClipRect(m_surface, &clip);
+    }
+
+    Rect clip() const
+    {
+      return Rect(m_surface->clip_rect.x, m_surface->clip_rect.y, m_surface->clip_rect.w, m_surface->clip_rect.h);
+    }
+
+    /// True for a display surface that is drawn on while the previous frame
+    /// is shown, so it doesn't hold the previous frame after a flip
+    bool doubleBuffered() const
+    {
+      return (m_surface->flags & SDL_DOUBLEBUF) != 0;
+    }
+
+    /// True if every pixel is fully opaque, i.e. blitting this surface
+    /// replaces whatever is below it
+    bool opaque() const
+    {
+      return !(m_surface->flags & (SDL_SRCALPHA | SDL_SRCCOLORKEY));
+    }
+
+    ~Surface()
+    {
+      surfaceMemory().remove(m_category, bytes());
+      SDL_FreeSurface(m_surface);
+    }
+
+    void render(Surface &t_surface, const Position &t_position) const
+    {
+      SDL_Rect dest;
+      dest.x = t_position.x();
+      dest.y = t_position.y();
+      dest.w = m_surface->w;
+      dest.h = m_surface->h;
+
+      blit(m_surface, bounds().toSDL(), t_surface.m_surface, dest);
+      ++t_surface.m_revision;
+      profiler().countBlit(dest.w * dest.h);
+    }
+
+    /// Renders only the t_source part of this surface, with its top left
+    /// corner placed at t_position
+    void render(Surface &t_surface, const Position &t_position, const Rect &t_source) const
+    {
+      SDL_Rect dest;
+      dest.x = t_position.x();
+      dest.y = t_position.y();
+      dest.w = t_source.w();
+      dest.h = t_source.h();
+
+      blit(m_surface, t_source.toSDL(), t_surface.m_surface, dest);
+      ++t_surface.m_revision;
+      profiler().countBlit(dest.w * dest.h);
+    }
+
+    Rect bounds() const
+    {
+      return Rect(0, 0, m_surface->w, m_surface->h);
+    }
+
+    /// Copies the pixels of t_area in t_source verbatim to the same place on
+    /// this surface, ignoring alpha and colour keys. Both surfaces must share
+    /// the same pixel format, as a surface and its copies do.
+    void copy(const Surface &t_source, const Rect &t_area)
+    {
+      const Rect area = t_area.intersect(bounds()).intersect(t_source.bounds());
+
+      if (area.empty())
+      {
+        return;
+      }
+
+      const size_t bpp = m_surface->format->BytesPerPixel;
+
+      if (t_source.m_surface->format->BytesPerPixel != bpp)
+      {
+        throw std::runtime_error("Unable to copy between surfaces of different pixel formats");
+      }
+
+      SDL_LockSurface(m_surface);
+      SDL_LockSurface(t_source.m_surface);
+      for (int y = area.y(); y < area.bottom(); ++y)
+      {
+        memcpy(static_cast<Uint8 *>(m_surface->pixels) + y * m_surface->pitch + area.x() * bpp,
+            static_cast<const Uint8 *>(t_source.m_surface->pixels) + y * t_source.m_surface->pitch + area.x() * bpp,
+            area.w() * bpp);
+      }
+      SDL_UnlockSurface(t_source.m_surface);
+      SDL_UnlockSurface(m_surface);
+      ++m_revision;
+    }
+
+    /// Replaces the pixels at t_x, t_y with all of t_source, alpha included,
+    /// converting it to this surface's pixel format. Colour keyed pixels
+    /// become transparent if this surface has an alpha channel.
+    void paste(const Surface &t_source, int t_x, int t_y)
+    {
+      const Rect area = t_source.bounds().translate(t_x, t_y).intersect(bounds());
+
+      if (area.empty())
+      {
+        return;
+      }
+
+      SDL_Surface *converted = (t_source.m_surface->flags & SDL_SRCCOLORKEY) && m_surface->format->Amask
+        ?SDL_DisplayFormatAlpha(t_source.m_surface)
+        :SDL_ConvertSurface(t_source.m_surface, m_surface->format, SDL_SWSURFACE);
+
+      if (!converted)
+      {
+        throw std::runtime_error(std::string("Unable to convert surface: ") + SDL_GetError());
+      }
+
+      if (converted->format->BytesPerPixel != m_surface->format->BytesPerPixel)
+      {
+        SDL_FreeSurface(converted);
+        throw std::runtime_error("Unable to paste between surfaces of different pixel formats");
+      }
+
+      const size_t bpp = m_surface->format->BytesPerPixel;
+
+      SDL_LockSurface(m_surface);
+      SDL_LockSurface(converted);
+      for (int y = area.y(); y < area.bottom(); ++y)
+      {
+        memcpy(static_cast<Uint8 *>(m_surface->pixels) + y * m_surface->pitch + area.x() * bpp,
+            static_cast<const Uint8 *>(converted->pixels) + (y - t_y) * converted->pitch + (area.x() - t_x) * bpp,
+            area.w() * bpp);
+      }
+      SDL_UnlockSurface(converted);
+      SDL_UnlockSurface(m_surface);
+      SDL_FreeSurface(converted);
+      ++m_revision;
+    }
+
+    /// Copies t_area of t_source with every pixel enlarged to a t_factor by
+    /// t_factor square, t_area's top left corner landing on t_x, t_y. Both
+    /// surfaces must share the same pixel format.
+    void enlarge(const Surface &t_source, const Rect &t_area, int t_factor, int t_x, int t_y)
+    {
+      const Rect area = t_area.intersect(t_source.bounds());
+      const size_t bpp = m_surface->format->BytesPerPixel;
+
+      if (t_source.m_surface->format->BytesPerPixel != bpp)
+      {
+        throw std::runtime_error("Unable to enlarge between surfaces of different pixel formats");
+      }
+
+      // only whole source pixels that land on this surface
+      const int left = std::max(area.x(), area.x() + (-t_x + t_factor - 1) / t_factor);
+      const int top = std::max(area.y(), area.y() + (-t_y + t_factor - 1) / t_factor);
+      const int right = std::min(area.right(), area.x() + (m_surface->w - t_x) / t_factor);
+      const int bottom = std::min(area.bottom(), area.y() + (m_surface->h - t_y) / t_factor);
+
+      if (left >= right || top >= bottom)
+      {
+        return;
+      }
+
+      const int x = t_x + (left - area.x()) * t_factor;
+      const size_t width = size_t(right - left) * t_factor * bpp;
+
+      SDL_LockSurface(m_surface);
+      SDL_LockSurface(t_source.m_surface);
+      for (int row = top; row < bottom; ++row)
+      {
+        const Uint8 *src = static_cast<const Uint8 *>(t_source.m_surface->pixels) + row * t_source.m_surface->pitch + left * bpp;
+        Uint8 *first = static_cast<Uint8 *>(m_surface->pixels)
+          + (t_y + (row - area.y()) * t_factor) * m_surface->pitch + x * bpp;
+
+        if (bpp == 4)
+        {
+          const Uint32 *in = reinterpret_cast<const Uint32 *>(src);
+          Uint32 *out = reinterpret_cast<Uint32 *>(first);
+          for (int i = 0; i < right - left; ++i)
+          {
+            for (int f = 0; f < t_factor; ++f)
+            {
+              *out++ = in[i];
+            }
+          }
+        } else {
+          Uint8 *out = first;
+          for (int i = 0; i < right - left; ++i)
+          {
+            for (int f = 0; f < t_factor; ++f)
+            {
+              memcpy(out, src + i * bpp, bpp);
+              out += bpp;
+            }
+          }
+        }
+
+        // the remaining rows of the enlarged row are copies of the first
+        for (int f = 1; f < t_factor; ++f)
+        {
+          memcpy(first + f * m_surface->pitch, first, width);
+        }
+      }
+      SDL_UnlockSurface(t_source.m_surface);
+      SDL_UnlockSurface(m_surface);
+      ++m_revision;
+    }
+
+    /// Sets t_area of this surface to t_source moved right and down by
+    /// t_xweight/256 and t_yweight/256 of a pixel, filtering bilinearly.
+    /// Translucent pixels are weighted by their alpha so transparent ones
+    /// bleed no colour, and outside of t_source counts as transparent, or as
+    /// the nearest edge pixel if there is no alpha channel. Both surfaces
+    /// must be 32 bit and share the same pixel format.
+    void resample(const Surface &t_source, const Rect &t_area, int t_xweight, int t_yweight)
+    {
+      const Rect area = t_area.intersect(bounds());
+      const SDL_PixelFormat *fmt = m_surface->format;
+      SDL_Surface *src = t_source.m_surface;
+
+      if (area.empty())
+      {
+        return;
+      }
+
+      if (fmt->BytesPerPixel != 4 || src->format->BytesPerPixel != 4)
+      {
+        throw std::runtime_error("Unable to resample surfaces that are not 32 bit");
+      }
+
+      const bool alpha = fmt->Amask != 0;
+      const int weights[4] = {
+        (256 - t_xweight) * (256 - t_yweight), t_xweight * (256 - t_yweight),
+        (256 - t_xweight) * t_yweight, t_xweight * t_yweight };
+
+      SDL_LockSurface(m_surface);
+      SDL_LockSurface(src);
+      for (int y = area.y(); y < area.bottom(); ++y)
+      {
+        Uint32 *row = reinterpret_cast<Uint32 *>(static_cast<Uint8 *>(m_surface->pixels) + y * m_surface->pitch);
+
+        for (int x = area.x(); x < area.right(); ++x)
+        {
+          Uint32 samples[4] = {
+            sample(src, x, y, alpha), sample(src, x - 1, y, alpha),
+            sample(src, x, y - 1, alpha), sample(src, x - 1, y - 1, alpha) };
+
+          int scaled[4];
+          Uint32 total = 0;
+          for (int i = 0; i < 4; ++i)
+          {
+            scaled[i] = alpha?weights[i] * int((samples[i] & fmt->Amask) >> fmt->Ashift) / 256:weights[i];
+            total += scaled[i];
+          }
+
+          Uint32 pixel = 0;
+          for (int shift = 0; shift < 32 && total > 0; shift += 8)
+          {
+            if (alpha && shift == fmt->Ashift)
+            {
+              continue;
+            }
+
+            Uint32 channel = 0;
+            for (int i = 0; i < 4; ++i)
+            {
+              channel += ((samples[i] >> shift) & 0xff) * scaled[i];
+            }
+            pixel |= (alpha?channel / total:channel >> 16) << shift;
+          }
+
+          if (alpha)
+          {
+            pixel |= ((total * 256 / 65536) << fmt->Ashift) & fmt->Amask;
+          }
+
+          row[x] = pixel;
+        }
+      }
+      SDL_UnlockSurface(src);
+      SDL_UnlockSurface(m_surface);
+      ++m_revision;
+    }
+
+    /// Exchanges pixels with t_other. Both keep their identities, so
+    /// anything holding on to this surface sees the new pixels.
+    void swap(Surface &t_other)
+    {
+      surfaceMemory().remove(m_category, bytes());
+      surfaceMemory().remove(t_other.m_category, t_other.bytes());
+      std::swap(m_surface, t_other.m_surface);
+      surfaceMemory().add(m_category, bytes());
+      surfaceMemory().add(t_other.m_category, t_other.bytes());
+      ++m_revision;
+      ++t_other.m_revision;
+    }
+
+    /// Unique for the lifetime of the program, unlike the surface's address
+    unsigned serial() const
+    {
+      return m_serial;
+    }
+
+    /// Changes whenever the pixels are modified, so copies kept elsewhere
+    /// (e.g. GPU textures) know when to refresh
+    unsigned revision() const
+    {
+      return m_revision;
+    }
+
+    double width() const
+    {
+      return m_surface->w;
+    }
+
+    double height() const
+    {
+      return m_surface->h;
+    }
+
+    size_t bytes() const
+    {
+      return size_t(m_surface->pitch) * m_surface->h;
+    }
+
+    /// What the pixels count towards in surfaceMemory(). Only bookkeeping,
+    /// so it can be changed on surfaces that are otherwise const.
+    void setCategory(Surface_Memory::Category t_category) const
+    {
+      if (t_category != m_category)
+      {
+        surfaceMemory().remove(m_category, bytes());
+        surfaceMemory().add(t_category, bytes());
+        m_category = t_category;
+      }
+    }
+
+    Surface_Memory::Category category() const
+    {
+      return m_category;
+    }
+
+  private:
+    friend class OpenGL_Renderer;
+    friend class Room_Pack;
+    friend class Banded_Renderer;
+
+    Surface &operator=(const Surface &);
+
+    static unsigned nextSerial()
+    {
+      static unsigned serial = 0;
+      return ++serial;
+    }
+
+    static Uint32 sample(SDL_Surface *t_surf, int t_x, int t_y, bool t_alpha)
+    {
+      if (t_x < 0 || t_y < 0 || t_x >= t_surf->w || t_y >= t_surf->h)
+      {
+        if (t_alpha)
+        {
+          return 0;
+        }
+
+        t_x = std::min(std::max(t_x, 0), t_surf->w - 1);
+        t_y = std::min(std::max(t_y, 0), t_surf->h - 1);
+      }
+
+      return reinterpret_cast<const Uint32 *>(static_cast<const Uint8 *>(t_surf->pixels) + t_y * t_surf->pitch)[t_x];
+    }
+
+    /// SDL_BlitSurface, done with the pixel kernels whenever both surfaces
+    /// are unlocked 32 bit surfaces with the same colour layout, and then
+    /// clipped the same way
+    static void blit(SDL_Surface *t_src, SDL_Rect t_src_rect, SDL_Surface *t_dst, SDL_Rect t_dst_rect)
+    {
+      const SDL_PixelFormat *src_fmt = t_src->format;
+      const SDL_PixelFormat *dst_fmt = t_dst->format;
+
+      if (src_fmt->BytesPerPixel != 4 || dst_fmt->BytesPerPixel != 4
+          || SDL_MUSTLOCK(t_src) || SDL_MUSTLOCK(t_dst)
+          || src_fmt->Rmask != dst_fmt->Rmask || src_fmt->Gmask != dst_fmt->Gmask || src_fmt->Bmask != dst_fmt->Bmask)
+      {
+        SDL_BlitSurface(t_src, &t_src_rect, t_dst, &t_dst_rect);
+        return;
+      }
+
+      enum { Copy, Blend, Colour_Key } mode = Copy;
+
+      if (t_src->flags & SDL_SRCALPHA)
+      {
+        if (src_fmt->Amask != 0xff000000 || src_fmt->alpha != SDL_ALPHA_OPAQUE)
+        {
+          SDL_BlitSurface(t_src, &t_src_rect, t_dst, &t_dst_rect);
+          return;
+        }
+        mode = Blend;
+      } else if (src_fmt->Amask != dst_fmt->Amask) {
+        // SDL fills in or drops the alpha channel
+        SDL_BlitSurface(t_src, &t_src_rect, t_dst, &t_dst_rect);
+        return;
+      } else if (t_src->flags & SDL_SRCCOLORKEY) {
+        mode = Colour_Key;
+      }
+
+      // clip to the source, then to the destination's clip rect
+      int sx = t_src_rect.x;
+      int sy = t_src_rect.y;
+      int dx = t_dst_rect.x;
+      int dy = t_dst_rect.y;
+      int w = t_src_rect.w;
+      int h = t_src_rect.h;
+
+      if (sx < 0) { w += sx; dx -= sx; sx = 0; }
+      if (sy < 0) { h += sy; dy -= sy; sy = 0; }
+      w = std::min(w, t_src->w - sx);
+      h = std::min(h, t_src->h - sy);
+
+      const SDL_Rect &clip = t_dst->clip_rect;
+      if (dx < clip.x) { w -= clip.x - dx; sx += clip.x - dx; dx = clip.x; }
+      if (dy < clip.y) { h -= clip.y - dy; sy += clip.y - dy; dy = clip.y; }
+      w = std::min(w, clip.x + clip.w - dx);
+      h = std::min(h, clip.y + clip.h - dy);
+
+      if (w <= 0 || h <= 0)
+      {
+        return;
+      }
+
+      const Pixel_Kernels &kernels = pixelKernels();
+      const Uint32 key_mask = ~src_fmt->Amask;
+      const Uint32 key = src_fmt->colorkey & key_mask;
+
+      for (int y = 0; y < h; ++y)
+      {
+        const Uint32 *src = reinterpret_cast<const Uint32 *>(static_cast<const Uint8 *>(t_src->pixels)
+            + (sy + y) * t_src->pitch) + sx;
+        Uint32 *dst = reinterpret_cast<Uint32 *>(static_cast<Uint8 *>(t_dst->pixels)
+            + (dy + y) * t_dst->pitch) + dx;
+
+        switch (mode)
+        {
+          case Copy:
+            kernels.copy(dst, src, w);
+            break;
+          case Blend:
+            kernels.blend(dst, src, w);
+            break;
+          case Colour_Key:
+            kernels.colourKey(dst, src, w, key, key_mask);
+            break;
+        }
+      }
+    }
+
+    /// SDL_FillRect, done with the fill kernel on unlocked 32 bit surfaces
+    static void fillRect(SDL_Surface *t_dst, SDL_Rect t_rect, Uint32 t_colour)
+    {
+      if (t_dst->format->BytesPerPixel != 4 || SDL_MUSTLOCK(t_dst))
+      {
+        SDL_FillRect(t_dst, &t_rect, t_colour);
+        return;
+      }
+
+      const SDL_Rect &clip = t_dst->clip_rect;
+      const int x = std::max(int(t_rect.x), int(clip.x));
+      const int y = std::max(int(t_rect.y), int(clip.y));
+      const int w = std::min(t_rect.x + t_rect.w, clip.x + clip.w) - x;
+      const int h = std::min(t_rect.y + t_rect.h, clip.y + clip.h) - y;
+
+      const Pixel_Kernels &kernels = pixelKernels();
+
+      for (int row = y; row < y + h && w > 0; ++row)
+      {
+        kernels.fill(reinterpret_cast<Uint32 *>(static_cast<Uint8 *>(t_dst->pixels) + row * t_dst->pitch) + x, w, t_colour);
+      }
+    }
+
+    static SDL_Surface *createDisplayFormat(int t_width, int t_height, bool t_alpha)
+    {
+      SDL_Surface *blank = SDL_CreateRGBSurface(SDL_SWSURFACE, t_width, t_height, 32,
+          0x00ff0000, 0x0000ff00, 0x000000ff, t_alpha?0xff000000:0);
+
+      if (!blank)
+      {
+        throw std::runtime_error(std::string("Unable to create surface: ") + SDL_GetError());
+      }
+
+      SDL_Surface *converted = t_alpha?SDL_DisplayFormatAlpha(blank):SDL_DisplayFormat(blank);
+      SDL_FreeSurface(blank);
+
+      if (!converted)
+      {
+        throw std::runtime_error(std::string("Unable to create surface: ") + SDL_GetError());
+      }
+
+      return converted;
+    }
+
+    static SDL_Surface *toDisplayFormat(SDL_Surface *loaded, const std::string &t_filename, bool t_rle)
+    {
+      if (!loaded)
+      {
+        throw std::runtime_error(std::string("Unable to load image: ") + t_filename + ": " + IMG_GetError());
+      }
+
+      const bool alpha = hasTranslucentPixels(loaded);
+      SDL_Surface *converted = alpha?SDL_DisplayFormatAlpha(loaded):SDL_DisplayFormat(loaded);
+      SDL_FreeSurface(loaded);
+
+      if (!converted)
+      {
+        throw std::runtime_error(std::string("Unable to convert image: ") + t_filename + ": " + SDL_GetError());
+      }
+
+      if (t_rle)
+      {
+        if (alpha)
+        {
+          SDL_SetAlpha(converted, SDL_SRCALPHA | SDL_RLEACCEL, SDL_ALPHA_OPAQUE);
+        } else if (converted->flags & SDL_SRCCOLORKEY) {
+          SDL_SetColorKey(converted, SDL_SRCCOLORKEY | SDL_RLEACCEL, converted->format->colorkey);
+        }
+      }
+
+      return converted;
+    }
+
+    /// PNGs are very often RGBA even when every pixel is opaque, scan for
+    /// real translucency so those can take the faster opaque blit path
+    static bool hasTranslucentPixels(SDL_Surface *t_surf)
+    {
+      const SDL_PixelFormat *fmt = t_surf->format;
+
+      if (!fmt->Amask)
+      {
+        return false;
+      }
+
+      if (fmt->BytesPerPixel != 4)
+      {
+        return true;
+      }
+
+      bool translucent = false;
+
+      SDL_LockSurface(t_surf);
+      for (int y = 0; y < t_surf->h && !translucent; ++y)
+      {
+        const Uint32 *row = reinterpret_cast<const Uint32 *>(static_cast<const Uint8 *>(t_surf->pixels) + y * t_surf->pitch);
+        for (int x = 0; x < t_surf->w; ++x)
+        {
+          if ((row[x] & fmt->Amask) != fmt->Amask)
+          {
+            translucent = true;
+            break;
+          }
+        }
+      }
+      SDL_UnlockSurface(t_surf);
+
+      return translucent;
+    }
+
+    SDL_Surface *m_surface;
+    unsigned m_serial;
+    unsigned m_revision;
+    mutable Surface_Memory::Category m_category;
+};
+
+#endif
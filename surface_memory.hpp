@@ -0,0 +1,124 @@
+#ifndef CHAIGAME_SURFACE_MEMORY_HPP_
+#define CHAIGAME_SURFACE_MEMORY_HPP_
+
+#include <algorithm>
+#include <cstddef>
+#include <ostream>
+
+/// Pixel memory held by every Surface, by what it is used for, with the
+/// highest each category and the total have reached. Surfaces count as
+/// plain images until whatever uses them says otherwise.
+/// A budget can be set; going over it doesn't fail anything, it is up to
+/// the main loop to release caches when overBudget(). Like the profiler,
+/// it is only used from the main thread.
+class Surface_Memory
+{
+  public:
+    enum Category
+    {
+      Image, // loaded, not yet used by anything
+      Layer_Backing,
+      Baked_Cache, // baked tiles and their pre-shifted copies
+      Sprite,
+      Screen,
+      Category_Count
+    };
+
+    static const char *name(Category t_category)
+    {
+      static const char *names[Category_Count] = { "image", "layer backing", "baked cache", "sprite", "screen" };
+      return names[t_category];
+    }
+
+    Surface_Memory()
+      : m_total(0), m_peak_total(0), m_budget(0)
+    {
+      for (int i = 0; i < Category_Count; ++i)
+      {
+        m_bytes[i] = 0;
+        m_peak[i] = 0;
+      }
+    }
+
+    void add(Category t_category, size_t t_bytes)
+    {
+      m_bytes[t_category] += t_bytes;
+      m_total += t_bytes;
+      m_peak[t_category] = std::max(m_peak[t_category], m_bytes[t_category]);
+      m_peak_total = std::max(m_peak_total, m_total);
+    }
+
+    void remove(Category t_category, size_t t_bytes)
+    {
+      m_bytes[t_category] -= t_bytes;
+      m_total -= t_bytes;
+    }
+
+    size_t bytes(Category t_category) const
+    {
+      return m_bytes[t_category];
+    }
+
+    size_t total() const
+    {
+      return m_total;
+    }
+
+    /// High-water marks
+    size_t peak(Category t_category) const
+    {
+      return m_peak[t_category];
+    }
+
+    size_t peakTotal() const
+    {
+      return m_peak_total;
+    }
+
+    /// In bytes, 0 for none
+    void setBudget(size_t t_bytes)
+    {
+      m_budget = t_bytes;
+    }
+
+    size_t budget() const
+    {
+      return m_budget;
+    }
+
+    bool overBudget() const
+    {
+      return m_budget > 0 && m_total > m_budget;
+    }
+
+    /// One line with the current and peak bytes of each category
+    void write(std::ostream &t_os) const
+    {
+      t_os << "Surface memory: " << m_total << " bytes, peak " << m_peak_total;
+      if (m_budget > 0)
+      {
+        t_os << ", budget " << m_budget;
+      }
+
+      for (int i = 0; i < Category_Count; ++i)
+      {
+        t_os << (i == 0?" (":", ") << name(Category(i)) << " " << m_bytes[i] << " peak " << m_peak[i];
+      }
+      t_os << ")";
+    }
+
+  private:
+    size_t m_bytes[Category_Count];
+    size_t m_peak[Category_Count];
+    size_t m_total;
+    size_t m_peak_total;
+    size_t m_budget;
+};
+
+inline Surface_Memory &surfaceMemory()
+{
+  static Surface_Memory instance;
+  return instance;
+}
+
+#endif
@@ -0,0 +1,342 @@
+#ifndef CHAIGAME_WORLD_HPP_
+#define CHAIGAME_WORLD_HPP_
+
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <vector>
+
+#include "geometry.hpp"
+#include "surface.hpp"
+#include "layer.hpp"
+#include "room.hpp"
+#include "asset_cache.hpp"
+
+/// Rooms laid out side by side, each covering an area of the world in the
+/// pixels of its center layer. Only the room the player is in is rendered.
+/// The rooms within the prefetch distance are built ahead of time, the ones
+/// the player is heading for first, at most one room per update(). Their
+/// images are decoded on the Asset_Cache's background threads if the
+/// builder requests them, and their tiles are baked a few at a time by the
+/// following updates, so no frame takes the whole cost and entering a room
+/// is only a matter of pointing at it. Rooms twice the prefetch distance away are
+/// released and built again if they come back into reach.
+class World
+{
+  public:
+    /// Lays out a room, returns its center layer
+    typedef boost::function<boost::shared_ptr<Layer> (Room &, Asset_Cache &)> Builder;
+
+    /// t_prebake_budget is the pieces of baking done per update(), see
+    /// Room::prebake()
+    World(Asset_Cache &t_assets, double t_prefetch_distance = 1024, size_t t_prebake_budget = 8)
+      : m_assets(t_assets), m_prefetch_distance(t_prefetch_distance), m_prebake_budget(t_prebake_budget), m_current(0),
+        m_dirty_rect_updates(false), m_buffered_entities(false), m_prefetched(0), m_missed(0)
+    {
+    }
+
+    /// Adds a room covering t_area of the world, built by t_build when it
+    /// is needed. Returns its index, the first room added is entered
+    /// first.
+    size_t addRoom(const Rect &t_area, const Builder &t_build)
+    {
+      m_rooms.push_back(Entry(t_area, t_build));
+      return m_rooms.size() - 1;
+    }
+
+    /// As above, for a room already built from t_build
+    size_t addRoom(const Rect &t_area, const Builder &t_build, const boost::shared_ptr<Room> &t_room,
+        const boost::shared_ptr<Layer> &t_center)
+    {
+      const size_t index = addRoom(t_area, t_build);
+      m_rooms[index].room = t_room;
+      m_rooms[index].center = t_center;
+      configure(*t_room);
+      return index;
+    }
+
+    /// The room the player is in, built if it isn't yet
+    Room &room()
+    {
+      return *built(m_current).room;
+    }
+
+    /// The layer the camera follows in room()
+    const boost::shared_ptr<Layer> &centerLayer()
+    {
+      return built(m_current).center;
+    }
+
+    size_t current() const
+    {
+      return m_current;
+    }
+
+    const Rect &area(size_t t_room) const
+    {
+      return m_rooms.at(t_room).area;
+    }
+
+    /// Applies Room::setDirtyRectUpdates() to every room, including those
+    /// built later
+    void setDirtyRectUpdates(bool t_enabled)
+    {
+      m_dirty_rect_updates = t_enabled;
+      forResident(&Room::setDirtyRectUpdates, t_enabled);
+    }
+
+    /// Applies Room::setBufferedEntities() to every room, including those
+    /// built later
+    void setBufferedEntities(bool t_buffered)
+    {
+      m_buffered_entities = t_buffered;
+      forResident(&Room::setBufferedEntities, t_buffered);
+    }
+
+    /// Follows the player at t_position in the current room, moving along
+    /// t_heading: enters the room the player moved into, builds or bakes
+    /// one of the rooms within reach and releases far ones. Call it between
+    /// frames. Returns how far positions in the old room have to move to
+    /// be relative to the room entered, (0, 0) if it didn't change.
+    Position update(const Position &t_position, const Position &t_heading)
+    {
+      const Rect &from = m_rooms[m_current].area;
+      const Position world(from.x() + t_position.x(), from.y() + t_position.y());
+      Position shift(0, 0);
+
+      if (!contains(from, world))
+      {
+        for (size_t i = 0; i < m_rooms.size(); ++i)
+        {
+          if (contains(m_rooms[i].area, world))
+          {
+            enter(i);
+            shift = Position(from.x() - m_rooms[i].area.x(), from.y() - m_rooms[i].area.y());
+            break;
+          }
+        }
+      }
+
+      prefetch(world, t_heading);
+
+      for (size_t i = 0; i < m_rooms.size(); ++i)
+      {
+        if (i != m_current && m_rooms[i].room && distance(m_rooms[i].area, world) > 2 * m_prefetch_distance)
+        {
+          m_rooms[i].room.reset();
+          m_rooms[i].center.reset();
+        }
+      }
+
+      return shift;
+    }
+
+    /// Lets every resident room know, see Room::surfacesChanged(). Rooms
+    /// not entered yet are baked again over the following updates.
+    void surfacesChanged(const std::vector<const Surface *> &t_changed)
+    {
+      for (size_t i = 0; i < m_rooms.size(); ++i)
+      {
+        if (m_rooms[i].room)
+        {
+          m_rooms[i].room->surfacesChanged(t_changed);
+          m_rooms[i].prebaked = false;
+        }
+      }
+    }
+
+    /// See Room::releaseCaches(), for every resident room. The rooms not
+    /// entered yet give up all their baked copies and are baked again over
+    /// the following updates.
+    size_t releaseCaches()
+    {
+      size_t released = 0;
+      for (size_t i = 0; i < m_rooms.size(); ++i)
+      {
+        if (m_rooms[i].room)
+        {
+          if (i != m_current)
+          {
+            m_rooms[i].prebaked = false;
+          }
+          released += m_rooms[i].room->releaseCaches(i == m_current);
+        }
+      }
+      return released;
+    }
+
+    size_t size() const
+    {
+      return m_rooms.size();
+    }
+
+    /// Rooms currently built
+    size_t resident() const
+    {
+      size_t count = 0;
+      for (size_t i = 0; i < m_rooms.size(); ++i)
+      {
+        count += m_rooms[i].room?1:0;
+      }
+      return count;
+    }
+
+    /// Rooms built ahead of being entered
+    size_t prefetched() const
+    {
+      return m_prefetched;
+    }
+
+    /// Rooms that had to be built as they were entered
+    size_t missed() const
+    {
+      return m_missed;
+    }
+
+  private:
+    World(const World &);
+    World &operator=(const World &);
+
+    struct Entry
+    {
+      Entry(const Rect &t_area, const Builder &t_build)
+        : area(t_area), build(t_build), prebaked(false)
+      {
+      }
+
+      Rect area;
+      Builder build;
+      boost::shared_ptr<Room> room; // NULL unless built
+      boost::shared_ptr<Layer> center;
+      bool prebaked; // fully baked since the room was built, its images changed or its caches were released
+    };
+
+    static bool contains(const Rect &t_area, const Position &t_p)
+    {
+      return t_p.x() >= t_area.x() && t_p.x() < t_area.right() && t_p.y() >= t_area.y() && t_p.y() < t_area.bottom();
+    }
+
+    /// From t_p to the nearest point of t_area, 0 inside it
+    static double distance(const Rect &t_area, const Position &t_p)
+    {
+      const double dx = std::max(std::max(t_area.x() - t_p.x(), t_p.x() - t_area.right()), 0.0);
+      const double dy = std::max(std::max(t_area.y() - t_p.y(), t_p.y() - t_area.bottom()), 0.0);
+      return sqrt(dx * dx + dy * dy);
+    }
+
+    template<typename Setting>
+    void forResident(void (Room::*t_set)(Setting), Setting t_value)
+    {
+      for (size_t i = 0; i < m_rooms.size(); ++i)
+      {
+        if (m_rooms[i].room)
+        {
+          ((*m_rooms[i].room).*t_set)(t_value);
+        }
+      }
+    }
+
+    void configure(Room &t_room) const
+    {
+      t_room.setDirtyRectUpdates(m_dirty_rect_updates);
+      t_room.setBufferedEntities(m_buffered_entities);
+    }
+
+    Entry &built(size_t t_room)
+    {
+      Entry &entry = m_rooms.at(t_room);
+
+      if (!entry.room)
+      {
+        boost::shared_ptr<Room> room(new Room());
+        entry.center = entry.build(*room, m_assets);
+
+        if (!entry.center)
+        {
+          throw std::runtime_error("Room builder returned no center layer");
+        }
+
+        configure(*room);
+        entry.room = room;
+        entry.prebaked = false;
+      }
+
+      return entry;
+    }
+
+    void enter(size_t t_room)
+    {
+      if (!m_rooms[t_room].room)
+      {
+        ++m_missed;
+      }
+
+      built(t_room).room->invalidate();
+      m_current = t_room;
+    }
+
+    /// Builds the room within reach the player is heading for most
+    /// directly, or else the nearest, or if every such room is built,
+    /// bakes some of one that isn't yet
+    void prefetch(const Position &t_world, const Position &t_heading)
+    {
+      const double speed = sqrt(t_heading.x() * t_heading.x() + t_heading.y() * t_heading.y());
+      size_t best = m_rooms.size();
+      double best_ahead = 0;
+      double best_distance = 0;
+
+      for (size_t i = 0; i < m_rooms.size(); ++i)
+      {
+        const Entry &entry = m_rooms[i];
+        const double d = distance(entry.area, t_world);
+
+        if (i == m_current || entry.room || d > m_prefetch_distance)
+        {
+          continue;
+        }
+
+        // cosine of the angle between the heading and the way to the room
+        const double cx = std::min(std::max(t_world.x(), double(entry.area.x())), double(entry.area.right()));
+        const double cy = std::min(std::max(t_world.y(), double(entry.area.y())), double(entry.area.bottom()));
+        const double ahead = (speed > 0 && d > 0)
+          ?((cx - t_world.x()) * t_heading.x() + (cy - t_world.y()) * t_heading.y()) / (speed * d):0;
+
+        if (best == m_rooms.size() || ahead > best_ahead || (ahead == best_ahead && d < best_distance))
+        {
+          best = i;
+          best_ahead = ahead;
+          best_distance = d;
+        }
+      }
+
+      if (best != m_rooms.size())
+      {
+        built(best);
+        ++m_prefetched;
+        return;
+      }
+
+      for (size_t i = 0; i < m_rooms.size(); ++i)
+      {
+        if (i != m_current && m_rooms[i].room && !m_rooms[i].prebaked)
+        {
+          m_rooms[i].prebaked = m_rooms[i].room->prebake(m_prebake_budget) < m_prebake_budget;
+          return;
+        }
+      }
+    }
+
+    Asset_Cache &m_assets;
+    double m_prefetch_distance; // in world pixels, from the player to a room's area
+    size_t m_prebake_budget;
+    std::vector<Entry> m_rooms;
+    size_t m_current;
+    bool m_dirty_rect_updates;
+    bool m_buffered_entities;
+    size_t m_prefetched;
+    size_t m_missed;
+};
+
+#endif